@@ -0,0 +1,454 @@
+#include "connectionserver.h"
+#include "connectionclient.h"
+#include "connectionshard.h"
+#include "encrypt.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+struct bench {
+	struct connection_pool *server;
+	int count;
+	// client[i] is attached to fd i or fd count + i
+	struct connection **client;
+	int *fd;
+	// reply size to each inbound message
+	int echo;
+	char *buffer;
+	int in;
+	// ids of the sessions, collected from inbound messages
+	int *id;
+	int ids;
+};
+
+static double
+now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+compare_double(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+pump(struct bench *b) {
+	int n;
+	do {
+		n = 0;
+		int i;
+		for (i=0;i<b->count;i++) {
+			struct connection_message m;
+			int type;
+			while ((type = cc_poll(b->client[i], &m)) != MESSAGE_EMPTY) {
+				if (type == MESSAGE_OUT) {
+					cp_recv(b->server, b->fd[i], m.buffer, m.sz);
+				}
+				++n;
+			}
+		}
+		struct pool_message m;
+		int type;
+		while ((type = cp_poll(b->server, &m)) != POOL_EMPTY) {
+			if (type == POOL_OUT && m.sz > 0) {
+				cc_recv(b->client[m.id % b->count], m.buffer, m.sz);
+			} else if (type == POOL_IN) {
+				++b->in;
+				if (b->ids < b->count)
+					b->id[b->ids++] = m.id;
+				if (b->echo > 0)
+					cp_send(b->server, m.id, b->buffer, b->echo);
+			}
+			++n;
+		}
+	} while (n > 0);
+}
+
+static void
+bench_open(struct bench *b, int count, const struct cp_config *cfg) {
+	b->server = cp_new_ex(cfg);
+	b->count = count;
+	b->client = malloc(count * sizeof(struct connection *));
+	b->fd = malloc(count * sizeof(int));
+	b->id = malloc(count * sizeof(int));
+	b->ids = 0;
+	b->echo = 0;
+	b->in = 0;
+	b->buffer = malloc(65536);
+	memset(b->buffer, 0, 65536);
+	int i;
+	for (i=0;i<count;i++) {
+		b->client[i] = cc_open();
+		b->fd[i] = i;
+	}
+	pump(b);
+}
+
+static void
+bench_close(struct bench *b) {
+	int i;
+	for (i=0;i<b->count;i++) {
+		cc_close(b->client[i]);
+	}
+	free(b->client);
+	free(b->fd);
+	free(b->id);
+	free(b->buffer);
+	cp_delete(b->server);
+}
+
+// every client receives some data, then drops its fd and resumes on a new one
+static void
+bench_reconnect(int count) {
+	struct bench b;
+	struct cp_config cfg = { .maxhandshake = count };
+	bench_open(&b, count, &cfg);
+	b.echo = 300;
+	int i;
+	for (i=0;i<count;i++) {
+		cc_send(b.client[i], "x", 1);
+	}
+	pump(&b);
+	b.echo = 0;
+
+	double t = now();
+	for (i=0;i<count;i++) {
+		cp_recv(b.server, b.fd[i], NULL, 0);
+		b.fd[i] = b.fd[i] < count ? b.fd[i] + count : b.fd[i] - count;
+		cc_handshake(b.client[i]);
+	}
+	pump(&b);
+	t = now() - t;
+
+	b.in = 0;
+	for (i=0;i<count;i++) {
+		cc_send(b.client[i], "y", 1);
+	}
+	pump(&b);
+	printf("reconnect %d sessions : %.3f s (%.0f /s), %d resumed\n", count, t, count / t, b.in);
+	bench_close(&b);
+}
+
+// walk the table by sending 1 byte to every attached session, so each cp_send reads the hot slot,
+// the rc4 state in the cold table and the tail page. the writes are polled between passes
+static void
+bench_sweep(int count) {
+	struct bench b;
+	struct cp_config cfg = { .maxhandshake = count };
+	bench_open(&b, count, &cfg);
+	int i,j;
+	for (i=0;i<count;i++) {
+		cc_send(b.client[i], "x", 1);
+	}
+	pump(&b);
+	int pass = 100;
+	double t = 0;
+	for (i=0;i<pass;i++) {
+		double start = now();
+		for (j=0;j<b.ids;j++) {
+			cp_send(b.server, b.id[j], "x", 1);
+		}
+		t += now() - start;
+		// the clients don't need them
+		struct pool_message m;
+		while (cp_poll(b.server, &m) != POOL_EMPTY)
+			;
+	}
+	printf("sweep %d sessions : %.2f ns per session\n", b.ids, t * 1e9 / pass / b.ids);
+	bench_close(&b);
+}
+
+// every client drops its fd, then tick until all the detached sessions expire
+static void
+bench_timeout(int count) {
+	struct bench b;
+	struct cp_config cfg = { .maxhandshake = count, .detached_timeout = 1000 };
+	bench_open(&b, count, &cfg);
+	cp_timeout(b.server, 0);
+	int i;
+	for (i=0;i<count;i++) {
+		cc_send(b.client[i], "x", 1);
+	}
+	pump(&b);
+	for (i=0;i<count;i++) {
+		cp_recv(b.server, b.fd[i], NULL, 0);
+	}
+	// the median of idle ticks, a cascade moves the sessions to a lower level once
+	double idle[999];
+	double expire = 0;
+	unsigned int tick;
+	for (tick=1;tick<=1000;tick++) {
+		double t = now();
+		cp_timeout(b.server, tick);
+		t = now() - t;
+		if (tick < 1000)
+			idle[tick-1] = t;
+		else
+			expire = t;
+	}
+	qsort(idle, 999, sizeof(double), compare_double);
+	printf("timeout %d sessions : %.0f ns per idle tick, %.2f ms to expire all\n", count, idle[499] * 1e9, expire * 1e3);
+	bench_close(&b);
+}
+
+struct shard_bench {
+	struct shard_pool *sp;
+	struct connection **client;
+	// deliver the writes to the clients during handshake, count them later
+	int deliver;
+	size_t in;
+	size_t out;
+};
+
+static void
+shard_data(void *ud, int id, const char *buffer, size_t sz) {
+	struct shard_bench *b = ud;
+	__atomic_fetch_add(&b->in, sz, __ATOMIC_RELAXED);
+	cs_send(b->sp, id, buffer, sz);
+}
+
+static void
+shard_write(void *ud, int fd, const char *buffer, size_t sz) {
+	struct shard_bench *b = ud;
+	// fd is owned by one shard, so the client is never touched by two threads
+	if (b->deliver)
+		cc_recv(b->client[fd], buffer, sz);
+	else
+		__atomic_fetch_add(&b->out, sz, __ATOMIC_RELAXED);
+}
+
+// the ciphertext of each client is made before, then echoed by the shards
+static double
+bench_shard(int shards, int count, int message, int messages) {
+	struct shard_bench b;
+	struct cs_config cfg = { .shards = shards, .pin = 1, .pool = { .maxhandshake = count, .on_data = shard_data, .on_write = shard_write, .ud = &b } };
+	b.sp = cs_new(&cfg);
+	b.client = malloc(count * sizeof(struct connection *));
+	b.deliver = 1;
+	b.in = 0;
+	b.out = 0;
+	int i,j;
+	for (i=0;i<count;i++) {
+		b.client[i] = cc_open();
+	}
+	int n;
+	do {
+		n = 0;
+		for (i=0;i<count;i++) {
+			// handshake messages, the client is written by the shard thread once cs_recv is called
+			char out[256];
+			int sz = 0;
+			struct connection_message m;
+			while (cc_poll(b.client[i], &m) == MESSAGE_OUT) {
+				memcpy(out + sz, m.buffer, m.sz);
+				sz += m.sz;
+				++n;
+			}
+			if (sz > 0)
+				cs_recv(b.sp, i, out, sz);
+		}
+		cs_wait(b.sp);
+	} while (n > 0);
+	b.deliver = 0;
+
+	char *stream = malloc((size_t)count * message * messages);
+	char *buffer = malloc(message);
+	memset(buffer, 0, message);
+	for (i=0;i<count;i++) {
+		char *p = stream + (size_t)i * message * messages;
+		for (j=0;j<messages;j++) {
+			cc_send(b.client[i], buffer, message);
+			struct connection_message m;
+			while (cc_poll(b.client[i], &m) == MESSAGE_OUT) {
+				memcpy(p, m.buffer, m.sz);
+				p += m.sz;
+			}
+		}
+	}
+
+	double t = now();
+	for (j=0;j<messages;j++) {
+		for (i=0;i<count;i++) {
+			cs_recv(b.sp, i, stream + ((size_t)i * messages + j) * message, message);
+		}
+	}
+	cs_wait(b.sp);
+	t = now() - t;
+	double mb = (b.in + b.out) / t / (1024 * 1024);
+	printf("shard %d threads : %.0f MB/s (in %zu, out %zu)\n", shards, mb, b.in, b.out);
+
+	cs_delete(b.sp);
+	for (i=0;i<count;i++) {
+		cc_close(b.client[i]);
+	}
+	free(b.client);
+	free(stream);
+	free(buffer);
+	return mb;
+}
+
+// full new handshakes one by one, each is 2 powmodp on both sides
+static void
+bench_handshake(int count) {
+	struct connection_pool *server = cp_new();
+	struct cc_config ccfg = { .sendcache = 1024 };
+	int i;
+	double t = now();
+	for (i=0;i<count;i++) {
+		struct connection *client = cc_open_ex(&ccfg);
+		cc_send(client, "x", 1);
+		int n;
+		do {
+			n = 0;
+			struct connection_message cm;
+			while (cc_poll(client, &cm) == MESSAGE_OUT) {
+				cp_recv(server, i, cm.buffer, cm.sz);
+				++n;
+			}
+			struct pool_message pm;
+			while (cp_poll(server, &pm) == POOL_OUT) {
+				cc_recv(client, pm.buffer, pm.sz);
+				++n;
+			}
+		} while (n > 0);
+		cp_recv(server, i, NULL, 0);
+		cc_close(client);
+	}
+	t = now() - t;
+	printf("handshake %d : %.0f /s\n", count, count / t);
+	cp_delete(server);
+}
+
+// the cost of one random_next of the generator seeded by getrandom
+static void
+bench_random(int count) {
+	struct random_state rs;
+	uint64_t x = 0;
+	int i;
+	random_init(&rs, 0);
+	double t = now();
+	for (i=0;i<count;i++) {
+		x ^= random_next(&rs);
+	}
+	t = now() - t;
+	printf("random %d : %.1f ns (%llx)\n", count, t * 1e9 / count, (unsigned long long)(x & 0xf));
+}
+
+// 10k new handshakes arrive in batches of 100 with a message of an established session in the middle,
+// the latency is from the start of the batch to the message polled
+static void
+bench_burst(int crypto, int keypairs) {
+	struct cp_config cfg = { .maxhandshake = 16384, .crypto = crypto, .keypairs = keypairs };
+	struct connection_pool *server = cp_new_ex(&cfg);
+	struct connection *client = cc_open();
+	cc_send(client, "x", 1);
+	int ready = 0;
+	while (!ready) {
+		struct connection_message cm;
+		while (cc_poll(client, &cm) == MESSAGE_OUT) {
+			cp_recv(server, 0, cm.buffer, cm.sz);
+		}
+		struct pool_message pm;
+		int type;
+		while ((type = cp_poll(server, &pm)) != POOL_EMPTY) {
+			if (type == POOL_IN)
+				ready = 1;
+			else if (pm.sz > 0)
+				cc_recv(client, pm.buffer, pm.sz);
+		}
+		if (crypto > 0 && !ready) {
+			struct pollfd pfd = { cp_submitfd(server), POLLIN, 0 };
+			poll(&pfd, 1, 10);
+		}
+	}
+
+	int batch = 100;
+	int batches = 100;
+	double latency[100];
+	uint8_t handshake[16];
+	memset(handshake, 0, 8);
+	int i,j;
+	int replies = 0;
+	double t = now();
+	for (i=0;i<batches;i++) {
+		double start = now();
+		double got = 0;
+		for (j=0;j<batch;j++) {
+			if (j == batch / 2) {
+				cc_send(client, "ping", 4);
+				struct connection_message cm;
+				while (cc_poll(client, &cm) == MESSAGE_OUT) {
+					cp_recv(server, 0, cm.buffer, cm.sz);
+				}
+			}
+			// 8 bytes 0 and B
+			uint64_t B = (uint64_t)rand() << 32 | rand();
+			memcpy(handshake + 8, &B, 8);
+			cp_recv(server, 1 + i * batch + j, (const char *)handshake, 16);
+		}
+		struct pool_message pm;
+		int type;
+		while ((type = cp_poll(server, &pm)) != POOL_EMPTY) {
+			if (type == POOL_IN) {
+				got = now();
+			} else if (pm.id != 0) {
+				++replies;
+			}
+		}
+		latency[i] = got - start;
+		// idle time between the batches
+		cp_timeout(server, i);
+	}
+	while (replies < batch * batches) {
+		struct pollfd pfd = { cp_submitfd(server), POLLIN, 0 };
+		poll(&pfd, 1, 10);
+		struct pool_message pm;
+		while (cp_poll(server, &pm) != POOL_EMPTY) {
+			if (pm.type == POOL_OUT && pm.id != 0)
+				++replies;
+		}
+	}
+	t = now() - t;
+	qsort(latency, batches, sizeof(double), compare_double);
+	printf("burst %d handshakes, %d crypto threads, %d keypairs : p50 %.0f us, p99 %.0f us, all replied in %.0f ms\n",
+		batch * batches, crypto, keypairs, latency[batches / 2] * 1e6, latency[batches * 99 / 100] * 1e6, t * 1e3);
+	cc_close(client);
+	cp_delete(server);
+}
+
+int
+main(int argc, char *argv[]) {
+	int count = 16384;
+	if (argc > 1) {
+		count = strtol(argv[1], NULL, 10);
+	}
+	bench_reconnect(count);
+	bench_sweep(count);
+	bench_timeout(count);
+
+	bench_random(10000000);
+	bench_handshake(10000);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	bench_burst(0, 0);
+	bench_burst(0, 100);
+	bench_burst(cpus > 1 ? cpus - 1 : 1, 0);
+	bench_burst(cpus > 1 ? cpus - 1 : 1, 100);
+	double base = bench_shard(1, 256, 1024, 128);
+	int shards;
+	for (shards=2;shards<=cpus && shards<=16;shards*=2) {
+		double mb = bench_shard(shards, 256, 1024, 128);
+		printf("shard %d threads : %.2fx\n", shards, mb / base);
+	}
+
+	return 0;
+}
@@ -27,6 +27,12 @@ local function poll()
 		if t == 1 then
 			-- message in
 			print("<=====", msg)
+		elseif t == 3 then
+			-- reset : the server lost the connection, start a new one
+			print("reset")
+			so:close()
+			so = assert(socket.connect(ip, port))
+			c:handshake()
 		else
 			-- message out
 			sendmsg(so, msg)
@@ -42,10 +48,8 @@ c:handshake()
 poll()
 c:send "abcdef"
 poll()
-local readsocket = { so }
-
 while true do
-	local r = socket.select(readsocket)
+	local r = socket.select { so }
 	assert(r[1] == so)
 	local msg = assert(so:recv())
 	c:recv(msg)
@@ -6,15 +6,38 @@
 #include <string.h>
 #include <assert.h>
 
-#define G 5
+// default geometry, see struct cc_config
 #define FINGERPRINTCHUNKSIZE 256
 #define SENDCACHESIZE 65536
 #define HANDSHAKE_HEADER 16
+// sendcount in the handshake reply when the server lost the connection
+#define HANDSHAKE_RESET 0xffffffffffffffffULL
+#define QUEUESIZE 1024
 
+// messages are stored in a ring, aligned to 8 bytes
 struct message {
-	struct message *next;
-	size_t sz;
-	uint8_t buffer[1];
+	uint32_t sz;	// MESSAGE_WRAP : the rest of the ring is unused
+	uint32_t reset;	// an empty in message of reset, see reset_connection()
+};
+
+#define MESSAGE_WRAP 0xffffffff
+
+// head ... read : polled messages, valid until the next cc_poll
+// read ... tail : messages to poll
+struct queue {
+	uint8_t *buffer;
+	size_t cap;
+	size_t head;
+	size_t read;
+	size_t tail;
+	int polled;
+	int unread;
+	// polled from buffer since the last grow
+	int pinned;
+	// buffers replaced by grow_queue() while they are pinned
+	int retired_n;
+	int retired_cap;
+	uint8_t **retired;
 };
 
 struct connection {
@@ -27,48 +50,176 @@ struct connection {
 	uint64_t sendcount;
 	struct rc4_sbox sendbox;
 	struct rc4_sbox recvbox;
-	uint8_t sendbuffer[SENDCACHESIZE];
+	int sendcache;
+	int chunksize;
+	uint8_t *sendbuffer;
 	uint32_t fingerprint;
+	// ack mode : data is framed by a 4 bytes size, size 0 is followed by 8 bytes recvcount
+	int ack;
+	uint64_t acked;
+	struct random_state random;
 
-	struct message *temp;
-
-	struct message *in_head;
-	struct message *in_tail;
-
-	struct message *out_head;
-	struct message *out_tail;
+	struct queue in;
+	struct queue out;
 
+	// plain text sent before handshake
 	size_t send_sz;
-	struct message *send_head;
-	struct message *send_tail;
+	size_t send_cap;
+	uint8_t *send_buffer;
 };
 
 static void
-free_message_queue(struct message *m) {
-	while (m) {
-		struct message *next = m->next;
-		free(m);
-		m = next;
+queue_init(struct queue *q) {
+	q->buffer = malloc(QUEUESIZE);
+	q->cap = QUEUESIZE;
+	q->head = 0;
+	q->read = 0;
+	q->tail = 0;
+	q->polled = 0;
+	q->unread = 0;
+	q->pinned = 0;
+	q->retired_n = 0;
+	q->retired_cap = 0;
+	q->retired = NULL;
+}
+
+static void
+queue_free_retired(struct queue *q) {
+	int i;
+	for (i=0;i<q->retired_n;i++) {
+		free(q->retired[i]);
 	}
+	q->retired_n = 0;
+}
+
+static void
+queue_exit(struct queue *q) {
+	queue_free_retired(q);
+	free(q->retired);
+	free(q->buffer);
 }
 
 void
 cc_close(struct connection *c) {
 	if (c == NULL)
 		return;
-	free(c->temp);
-	free_message_queue(c->in_head);
-	free_message_queue(c->out_head);
-	free_message_queue(c->send_head);
+	queue_exit(&c->in);
+	queue_exit(&c->out);
+	free(c->send_buffer);
+	free(c->sendbuffer);
 	free(c);
 }
 
+static inline size_t
+message_size(size_t sz) {
+	return (sizeof(struct message) + sz + 7) & ~(size_t)7;
+}
+
+// the message at offset, skip the wrap mark
+static inline struct message *
+queue_message(struct queue *q, size_t *offset) {
+	struct message *m = (struct message *)(q->buffer + *offset);
+	if (*offset == q->cap || m->sz == MESSAGE_WRAP) {
+		*offset = 0;
+		m = (struct message *)q->buffer;
+	}
+	return m;
+}
+
+// move all the messages to a larger buffer, the old one is kept while it's pinned
+static void
+grow_queue(struct queue *q, size_t need) {
+	size_t cap = q->cap * 2;
+	while (cap < q->cap + need)
+		cap *= 2;
+	uint8_t *buffer = malloc(cap);
+	size_t offset = q->head;
+	size_t tail = 0;
+	int i;
+	for (i=0;i<q->polled + q->unread;i++) {
+		if (i == q->polled) {
+			q->read = tail;
+		}
+		struct message *m = queue_message(q, &offset);
+		size_t sz = message_size(m->sz);
+		memcpy(buffer + tail, m, sz);
+		offset += sz;
+		tail += sz;
+	}
+	if (q->unread == 0) {
+		q->read = tail;
+	}
+	if (q->pinned > 0) {
+		if (q->retired_n >= q->retired_cap) {
+			q->retired_cap = q->retired_cap * 2 + 1;
+			q->retired = realloc(q->retired, q->retired_cap * sizeof(uint8_t *));
+		}
+		q->retired[q->retired_n++] = q->buffer;
+		q->pinned = 0;
+	} else {
+		free(q->buffer);
+	}
+	q->buffer = buffer;
+	q->cap = cap;
+	q->head = 0;
+	q->tail = tail;
+}
+
 static struct message *
-new_message(size_t sz) {
-	struct message * m = malloc(sizeof(*m) -1 + sz);
-	m->sz = sz;
-	m->next = NULL;
+queue_push(struct queue *q, size_t sz) {
+	size_t need = message_size(sz);
+	if (q->polled + q->unread == 0) {
+		q->head = q->read = q->tail = 0;
+	}
+	if (q->tail > q->head || q->polled + q->unread == 0) {
+		if (q->cap - q->tail < need) {
+			if (q->head >= need) {
+				if (q->tail < q->cap) {
+					((struct message *)(q->buffer + q->tail))->sz = MESSAGE_WRAP;
+				}
+				q->tail = 0;
+			} else {
+				grow_queue(q, need);
+			}
+		}
+	} else if (q->head - q->tail < need) {
+		grow_queue(q, need);
+	}
+	struct message *m = (struct message *)(q->buffer + q->tail);
+	m->sz = (uint32_t)sz;
+	m->reset = 0;
+	q->tail += need;
+	++q->unread;
+	return m;
+}
 
+// drop the messages not polled yet
+static void
+queue_clear(struct queue *q) {
+	q->tail = q->read;
+	q->unread = 0;
+}
+
+// release the polled messages
+static void
+queue_release(struct queue *q) {
+	q->head = q->read;
+	q->polled = 0;
+	q->pinned = 0;
+	if (q->retired_n > 0) {
+		queue_free_retired(q);
+	}
+}
+
+static struct message *
+queue_pop(struct queue *q) {
+	if (q->unread == 0)
+		return NULL;
+	struct message *m = queue_message(q, &q->read);
+	q->read += message_size(m->sz);
+	--q->unread;
+	++q->polled;
+	++q->pinned;
 	return m;
 }
 
@@ -101,55 +252,43 @@ uint32le(uint8_t *t, uint32_t v) {
 
 static uint8_t *
 new_inmessage(struct connection *c, size_t sz) {
-	struct message *m = new_message(sz);
-	if (c->in_tail) {
-		c->in_tail->next = m;
-		c->in_tail = m;
-	} else {
-		c->in_head = c->in_tail = m;
-	}
-	return m->buffer;
+	struct message *m = queue_push(&c->in, sz);
+	return (uint8_t *)(m+1);
 }
 
 static uint8_t *
 new_outmessage(struct connection *c, size_t sz) {
-	struct message *m = new_message(sz);
-	if (c->out_tail) {
-		c->out_tail->next = m;
-		c->out_tail = m;
-	} else {
-		c->out_head = c->out_tail = m;
-	}
-	return m->buffer;
+	struct message *m = queue_push(&c->out, sz);
+	return (uint8_t *)(m+1);
 }
 
 static uint8_t *
 new_sendmessage(struct connection *c, size_t sz) {
-	struct message *m = new_message(sz);
-	if (c->send_tail) {
-		c->send_tail->next = m;
-		c->send_tail = m;
-	} else {
-		c->send_head = c->send_tail = m;
+	if (c->send_sz + sz > c->send_cap) {
+		size_t cap = c->send_cap * 2;
+		while (cap < c->send_sz + sz)
+			cap *= 2;
+		c->send_buffer = realloc(c->send_buffer, cap);
+		c->send_cap = cap;
 	}
+	uint8_t * buffer = c->send_buffer + c->send_sz;
 	c->send_sz += sz;
-	return m->buffer;
+	return buffer;
 }
 
 void 
 cc_handshake(struct connection *c) {
 	c->handshake_sz = 0;
 	// drop send queue
-	free_message_queue(c->out_head);
-	c->out_head = c->out_tail = NULL;
+	queue_clear(&c->out);
 	// send new handshake message
 	if (c->recvcount == 0) {
-		c->secret = randomint64();
+		c->secret = random_next(&c->random);
 		// send 8 bytes count (0), 8 bytes secret
 		uint8_t * outmessage = new_outmessage(c, 16);
 
 		uint64le(outmessage, 0);
-		uint64_t A = powmodp(G, c->secret);
+		uint64_t A = powmodg(c->secret);
 		uint64le(outmessage+8, A);
 	} else {
 		// send 8 bytes count, 4 bytes fingerprint
@@ -161,17 +300,41 @@ cc_handshake(struct connection *c) {
 
 struct connection *
 cc_open() {
+	return cc_open_ex(NULL);
+}
+
+struct connection *
+cc_open_ex(const struct cc_config *config) {
+	struct cc_config cfg = { SENDCACHESIZE, FINGERPRINTCHUNKSIZE, 0, SENDCACHESIZE, 0 };
+	if (config) {
+		if (config->sendcache > 0)
+			cfg.sendcache = config->sendcache;
+		if (config->fingerprint > 0)
+			cfg.fingerprint = config->fingerprint;
+		if (config->ack > 0)
+			cfg.ack = config->ack;
+		if (config->window > 0)
+			cfg.window = config->window;
+		cfg.seed = config->seed;
+	}
+	if (cfg.ack > cfg.window / 2) {
+		// the server blocks at window unacked bytes, ack before it
+		cfg.ack = cfg.window > 1 ? cfg.window / 2 : 1;
+	}
 	struct connection * c = malloc(sizeof(*c));
+	c->sendcache = cfg.sendcache;
+	c->chunksize = cfg.fingerprint;
+	c->sendbuffer = malloc(cfg.sendcache);
 	c->handshake_sz = 0;
 	c->recvcount = 0;
-	c->temp = NULL;
-	c->in_head = NULL;
-	c->in_tail = NULL;
-	c->out_head = NULL;
-	c->out_tail = NULL;
-	c->send_head = NULL;
-	c->send_tail = NULL;
+	c->ack = cfg.ack;
+	c->acked = 0;
+	random_init(&c->random, cfg.seed);
+	queue_init(&c->in);
+	queue_init(&c->out);
 	c->send_sz = 0;
+	c->send_cap = QUEUESIZE;
+	c->send_buffer = malloc(QUEUESIZE);
 
 	cc_handshake(c);
 
@@ -184,35 +347,38 @@ drop_connection(struct connection *c) {
 	c->handshake_sz = -1;
 }
 
+// the next cc_handshake starts a new connection
+static void
+reset_connection(struct connection *c) {
+	struct message *m = queue_push(&c->in, 0);
+	m->reset = 1;
+	c->handshake_sz = -1;
+	c->recvcount = 0;
+	c->acked = 0;
+}
+
 static void
 update_sendcache(struct connection *c, const uint8_t * temp, size_t sz) {
 	c->sendcount += sz;
-	if (sz > SENDCACHESIZE) {
-		temp = temp + sz - SENDCACHESIZE;
-		sz = SENDCACHESIZE;
+	if (sz > c->sendcache) {
+		temp = temp + sz - c->sendcache;
+		sz = c->sendcache;
 	}
-	int offset = c->sendcount % SENDCACHESIZE;
+	int offset = c->sendcount % c->sendcache;
 	if (sz <= offset) {
 		memcpy(c->sendbuffer + offset - sz, temp, sz);
 	} else {
 		int part1 = sz - offset;
-		memcpy(c->sendbuffer + SENDCACHESIZE - part1, temp, part1);
+		memcpy(c->sendbuffer + c->sendcache - part1, temp, part1);
 		memcpy(c->sendbuffer, temp + part1, sz - part1);
 	}
 }
 
 static void
 encode_send_message(struct connection *c, uint8_t * buffer) {
-	struct message * m = c->send_head;
-	while(m) {
-		rc4_encode(&c->sendbox, m->buffer, buffer, m->sz);
-		buffer += m->sz;
-		m = m->next;
-	}
-
-	update_sendcache(c, buffer - c->send_sz, c->send_sz);
+	rc4_encode(&c->sendbox, c->send_buffer, buffer, c->send_sz);
+	update_sendcache(c, buffer, c->send_sz);
 
-	c->send_head = c->send_tail = NULL;
 	c->send_sz = 0;
 }
 
@@ -237,7 +403,11 @@ handshake(struct connection *c, const char *buffer, size_t sz) {
 		c->fingerprint = rc4_init(&c->recvbox, c->secret);
 		B = 0;
 	} else {
-		if (B > c->sendcount || B + SENDCACHESIZE < c->sendcount) {
+		if (B == HANDSHAKE_RESET) {
+			reset_connection(c);
+			return 0;
+		}
+		if (B > c->sendcount || B + c->sendcache < c->sendcount) {
 			drop_connection(c);
 			return 0;
 		}
@@ -249,12 +419,12 @@ handshake(struct connection *c, const char *buffer, size_t sz) {
 	uint64le(outbuffer, authcode);
 	outbuffer += 8;
 	if (bytes > 0) {
-		int offset = c->sendcount % SENDCACHESIZE;
+		int offset = c->sendcount % c->sendcache;
 		if (bytes <= offset) {
 			memcpy(outbuffer, c->sendbuffer + offset-bytes, bytes);
 		} else {
-			int part1 = offset - bytes;
-			memcpy(outbuffer, c->sendbuffer + SENDCACHESIZE - part1, part1);
+			int part1 = bytes - offset;
+			memcpy(outbuffer, c->sendbuffer + c->sendcache - part1, part1);
 			memcpy(outbuffer + part1, c->sendbuffer, offset);
 		}
 		outbuffer += bytes;
@@ -267,35 +437,100 @@ handshake(struct connection *c, const char *buffer, size_t sz) {
 	return need;
 }
 
-void
-cc_recv(struct connection *c, const char * buffer, size_t sz) {
+// decode sz bytes from src to des, and update the fingerprint at the checkpoint
+static void
+recv_bytes(struct connection *c, const char * src, uint8_t * des, size_t sz) {
+	int tail = (c->recvcount + sz) % c->chunksize;
+	if (tail > sz) {
+		rc4_decode(&c->recvbox, (const uint8_t *)src, des, sz);
+	} else {
+		size_t bytes = sz - tail;
+		c->fingerprint = rc4_decode(&c->recvbox, (const uint8_t *)src, des, bytes);
+		rc4_decode(&c->recvbox, (const uint8_t *)src + bytes, des + bytes, tail);
+	}
+	c->recvcount += sz;
+}
+
+// send header (may be empty) and buffer as one message
+static void
+send_frame(struct connection *c, const uint8_t *header, size_t hsz, const uint8_t * buffer, size_t sz) {
+	if (c->handshake_sz < HANDSHAKE_HEADER) {
+		// wait for handshake
+		uint8_t * temp = new_sendmessage(c, hsz + sz);
+		// header or buffer is NULL when it's empty
+		if (hsz > 0)
+			memcpy(temp, header, hsz);
+		if (sz > 0)
+			memcpy(temp + hsz, buffer, sz);
+		return;
+	}
+	assert(c->send_sz == 0);
+	uint8_t * temp = new_outmessage(c, hsz + sz);
+	if (hsz > 0)
+		rc4_encode(&c->sendbox, header, temp, hsz);
+	if (sz > 0)
+		rc4_encode(&c->sendbox, buffer, temp + hsz, sz);
+
+	update_sendcache(c, temp, hsz + sz);
+}
+
+// ack mode : tell the server the recvcount every c->ack bytes (at most half of the window), so it can free the replay cache
+static void
+send_ack(struct connection *c) {
+	if (c->ack == 0 || c->handshake_sz < HANDSHAKE_HEADER || c->recvcount - c->acked < c->ack)
+		return;
+	uint8_t frame[12];
+	uint32le(frame, 0);
+	uint64le(frame+4, c->recvcount);
+	send_frame(c, frame, 12, NULL, 0);
+	c->acked = c->recvcount;
+}
+
+// return the bytes used by handshake, or -1 if there is no more data
+static int
+recv_handshake(struct connection *c, const char * buffer, size_t sz) {
 	if (c->handshake_sz < 0) {
 		// connection closed
-		return;
+		return -1;
 	}
 	if (sz == 0) {
 		drop_connection(c);
-		return;
+		return -1;
 	}
 	if (c->handshake_sz < HANDSHAKE_HEADER) {
 		int n = handshake(c, buffer, sz);
-		if (n == 0)
-			return;
-		buffer += n;
-		sz -= n;
-	}
-	if (sz > 0) {
-		uint8_t * inmessage = new_inmessage(c, sz);
-		int tail = (c->recvcount + sz) % FINGERPRINTCHUNKSIZE;
-		if (tail > sz) {
-			rc4_encode(&c->recvbox, (const uint8_t *)buffer, inmessage, sz);
-		} else {
-			size_t bytes = sz - tail;
-			c->fingerprint = rc4_encode(&c->recvbox, (const uint8_t *)buffer, inmessage, bytes);
-			rc4_encode(&c->recvbox, (const uint8_t *)buffer + bytes, inmessage + bytes, tail);
-		}
-		c->recvcount += sz;
+		if (n == 0 || n == sz)
+			return -1;
+		return n;
 	}
+	return 0;
+}
+
+void
+cc_recv(struct connection *c, const char * buffer, size_t sz) {
+	int n = recv_handshake(c, buffer, sz);
+	if (n < 0)
+		return;
+	buffer += n;
+	sz -= n;
+	uint8_t * inmessage = new_inmessage(c, sz);
+	recv_bytes(c, buffer, inmessage, sz);
+	send_ack(c);
+}
+
+int
+cc_recv_inplace(struct connection *c, char * buffer, size_t sz, struct connection_message *m) {
+	int n = recv_handshake(c, buffer, sz);
+	if (n < 0)
+		return MESSAGE_EMPTY;
+	buffer += n;
+	sz -= n;
+	recv_bytes(c, buffer, (uint8_t *)buffer, sz);
+	send_ack(c);
+	m->type = MESSAGE_IN;
+	m->sz = sz;
+	m->buffer = buffer;
+	return MESSAGE_IN;
 }
 
 void
@@ -308,52 +543,47 @@ cc_send(struct connection *c, const char * buffer, size_t sz) {
 		cc_handshake(c);
 		return;
 	}
-	if (c->handshake_sz < HANDSHAKE_HEADER) {
-		// wait for handshake
-		uint8_t * temp = new_sendmessage(c, sz);
-		memcpy(temp, buffer, sz);
-		return;
+	if (c->ack > 0) {
+		uint8_t header[4];
+		uint32le(header, (uint32_t)sz);
+		send_frame(c, header, 4, (const uint8_t *)buffer, sz);
+	} else {
+		send_frame(c, NULL, 0, (const uint8_t *)buffer, sz);
 	}
-	assert(c->send_head == NULL);
-	uint8_t * temp = new_outmessage(c, sz);
-	rc4_encode(&c->sendbox, (const uint8_t *)buffer, temp, sz);
-
-	update_sendcache(c, temp, sz);
 }
 
 static void
-fill_message(struct connection *c, struct connection_message *m) {
-	m->sz = c->temp->sz;
+fill_message(struct message *msg, struct connection_message *m) {
+	m->sz = msg->sz;
 	if (m->sz == 0) {
 		m->buffer = NULL;
 	} else {
-		m->buffer = (const char *)c->temp->buffer;
+		m->buffer = (const char *)(msg+1);
 	}
 }
 
-int 
-cc_poll(struct connection *c, struct connection_message *m) {
-	if (c->temp) {
-		free(c->temp);
-		c->temp = NULL;
+int
+cc_poll_batch(struct connection *c, struct connection_message *m, int n) {
+	queue_release(&c->out);
+	queue_release(&c->in);
+	int i = 0;
+	struct message *msg;
+	while (i < n && (msg = queue_pop(&c->out))) {
+		fill_message(msg,&m[i]);
+		m[i].type = MESSAGE_OUT;
+		++i;
 	}
-	if (c->out_head) {
-		c->temp = c->out_head;
-		c->out_head = c->temp->next;
-		if (c->out_head == NULL) {
-			c->out_tail = NULL;
-		}
-		fill_message(c,m);
-		return MESSAGE_OUT;
-	} 
-	if (c->in_head) {
-		c->temp = c->in_head;
-		c->in_head = c->temp->next;
-		if (c->in_head == NULL) {
-			c->in_tail = NULL;
-		}
-		fill_message(c,m);
-		return MESSAGE_IN;
+	while (i < n && (msg = queue_pop(&c->in))) {
+		fill_message(msg,&m[i]);
+		m[i].type = msg->reset ? MESSAGE_RESET : MESSAGE_IN;
+		++i;
 	}
-	return MESSAGE_EMPTY;
+	return i;
+}
+
+int 
+cc_poll(struct connection *c, struct connection_message *m) {
+	if (cc_poll_batch(c, m, 1) == 0)
+		return MESSAGE_EMPTY;
+	return m->type;
 }
@@ -2,15 +2,27 @@
 #define connection_client_h
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct connection;
 
 struct connection_message {
+	int type;
 	int sz;
 	const char * buffer;
 };
 
+// 0 means the default value
+struct cc_config {
+	int sendcache;	// bytes of replay cache
+	int fingerprint;	// checkpoint granularity, must match the server
+	int ack;	// send the recvcount to server every ack bytes, the server must enable ack too. 0 : disabled
+	int window;	// sendcache of the server in ack mode, ack is lowered to half of it. default is 65536
+	uint64_t seed;	// seed of the random generator for reproducible runs, default is from the system entropy
+};
+
 struct connection * cc_open();
+struct connection * cc_open_ex(const struct cc_config *config);
 void cc_close(struct connection *);
 void cc_handshake(struct connection *);
 
@@ -20,7 +32,13 @@ void cc_recv(struct connection *, const char * buffer, size_t sz);
 #define MESSAGE_EMPTY 0
 #define MESSAGE_IN 1
 #define MESSAGE_OUT 2
+// the server lost the connection, cc_handshake on a new socket starts a new one
+#define MESSAGE_RESET 3
 
 int cc_poll(struct connection *, struct connection_message *);
+// fill at most n messages, returns the number of messages
+int cc_poll_batch(struct connection *, struct connection_message *m, int n);
+// same as cc_recv, but decrypt in buffer. returns MESSAGE_IN with the plain text in m, or MESSAGE_EMPTY
+int cc_recv_inplace(struct connection *, char * buffer, size_t sz, struct connection_message *m);
 
 #endif
@@ -5,151 +5,894 @@
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
-
-#define G 5
+#include <limits.h>
+
+// build with -DCONNECTION_THREAD -lpthread for cp_submit and the crypto threads
+#ifdef CONNECTION_THREAD
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+// default geometry, see struct cp_config
 #define FINGERPRINTCHUNKSIZE 256
 #define SENDCACHESIZE 65536
-#define FDHASHSIZE 16383
-#define MAXSOCKET 16384
+#define FDSIZE 1024
+#define MAXHANDSHAKE 4096
+// in ticks of cp_timeout, 1/100 s
+#define HANDSHAKETIMEOUT 1000
+#define DETACHEDTIMEOUT 30000
+#define QUEUESIZE 4096
+#define MAXSOCKET 0
+#define PAGESIZE 4096
+// connections are allocated by segments, and never move
+#define SEGMENT_BITS 8
+#define SEGMENT_SIZE (1 << SEGMENT_BITS)
+// replay cache pages are allocated by blocks, and never move
+#define PAGEBLOCK_BITS 6
+#define PAGEBLOCK_SIZE (1 << PAGEBLOCK_BITS)
+#define FPHASHSIZE 1024
+// id = version << ID_SLOTBITS | (slot + 1), so id is never 0.
+// the version of a slot wraps, a stale id matches again only after ID_VERSIONS sessions of its slot
+#define ID_SLOTBITS 24
+#define ID_VERSIONS 128
+// fpnext[] of a checkpoint not in the fingerprint index
+#define FP_NONE -2
+// fdslot.handshake of a rejected fd, until its close message is polled
+#define HANDSHAKE_CLOSING -2
+// hierarchical timing wheel : near[256] and 4 levels of 64 buckets, see timer_place()
+#define TIME_NEAR_SHIFT 8
+#define TIME_NEAR (1 << TIME_NEAR_SHIFT)
+#define TIME_LEVEL_SHIFT 6
+#define TIME_LEVEL (1 << TIME_LEVEL_SHIFT)
+#define TIME_NEAR_MASK (TIME_NEAR-1)
+#define TIME_LEVEL_MASK (TIME_LEVEL-1)
+#define TIME_BUCKETS (TIME_NEAR + 4 * TIME_LEVEL)
+// timer node of a handshake or a detached connection
+#define TIMER_HANDSHAKE(index) ((index) * 2)
+#define TIMER_CONNECTION(slot) ((slot) * 2 + 1)
+// connection_cold.lru_prev of a connection not in the lru list
+#define LRU_NONE -2
+// sendcount in the reply of a failed resume, the client should handshake as a new one
+#define HANDSHAKE_RESET 0xffffffffffffffffULL
+
+struct timer_node {
+	int next;
+	int prev;
+	int bucket;	// -1 when it's not in the wheel
+	uint32_t expire;
+};
+
+// D-H of a new handshake, computed by a crypto thread
+struct crypto_job {
+	struct crypto_job *next;
+	int index;
+	uint32_t serial;
+	uint64_t B;
+	// A is 0 if a is not taken from the reservoir
+	uint64_t a;
+	uint64_t A;
+	uint64_t secret;
+};
 
 struct handshake {
+	// free list
+	int next;
 	int fd;
-	int version;
 	int sz;
 	int closed;
+	// the D-H of a new handshake is computed by a crypto thread, see crypto_message()
+	int pending;
+	// changed when the handshake is reused, a completion always belongs to the current one
+	uint32_t serial;
+	// not reused until the job is done, so it's not allocated for each handshake
+	struct crypto_job job;
 	// 8 bytes index, 8 bytes A , 8 bytes auth
 	uint8_t buffer[8+8+8];
 	uint64_t secret;
 	uint64_t challenge;
 	uint64_t request;
 	uint32_t id;
-	struct handshake *next;
+	struct timer_node timer;
 };
 
-struct connection_handshake {
-	int version;
-	struct handshake * c[FDHASHSIZE];
+// an fd is bound to either a connection or a handshake
+struct fdslot {
+	int connection;	// slot, or -1
+	int handshake;	// index of cp->handshake, or -1
 };
 
+// keep it small, the connection table is walked by slot
 struct connection {
+	// free list when id == 0
 	int next;
 	uint32_t id;
+	int version;
 	int fd;
-	uint64_t secret;
 	uint64_t recvcount;
 	uint64_t sendcount;
+	// replay cache, a list of pages from head to tail. tail page holds sendcount
+	int head;
+	int tail;
+};
+
+// the state a lookup by id or fd doesn't need, at the same slot of a parallel table, see get_cold()
+struct connection_cold {
+	uint64_t secret;
+	// the last out message of the connection, see new_refmessage()
+	uint64_t outseq;
+	size_t outpos;
+	// expire when fd < 0
+	struct timer_node timer;
+	// detached connections from the oldest, see limit_memory()
+	int lru_prev;
+	int lru_next;
+	// ack mode : sendcount acked by the client, and the frame parser of the in stream, see recv_frame()
+	uint64_t acked;
+	uint32_t remain;
+	int framesz;
+	uint8_t frame[12];
+	// ack mode : size of the message refused for the window, see reopen_window()
+	uint32_t blocked;
 	struct rc4_sbox sendbox;
 	struct rc4_sbox recvbox;
-	uint8_t sendbuffer[SENDCACHESIZE];
-	uint32_t fingerprint[SENDCACHESIZE/FINGERPRINTCHUNKSIZE];
 };
 
+// a page of replay cache is followed by
+// uint32_t fingerprint[cp->pagechunks], int fpnext[cp->pagechunks], uint8_t data[cp->pagesize]
+// fingerprint[i] is the checkpoint at offset + i * cp->chunksize
+struct page {
+	// next page of the owner, or free list
+	int next;
+	// slot of the owner connection, -1 when free
+	int owner;
+	// out messages referring to this page, it's not reused until they are polled
+	int pin;
+	// sendcount of data[0]
+	uint64_t offset;
+};
+
+// messages are stored in a ring, aligned to 8 bytes
 struct message {
-	struct message *next;
+	int id;
+	uint32_t sz;	// MESSAGE_WRAP : the rest of the ring is unused
+};
+
+#define MESSAGE_WRAP 0xffffffff
+// the message is a struct message_ref, sz is the size of data it refers to
+#define MESSAGE_REF 0x80000000
+
+// ciphertext in the replay cache, sent without a copy
+struct message_ref {
+	int page;
+	int offset;
+};
+
+// head ... read : polled messages, valid until the next cp_poll
+// read ... tail : messages to poll
+struct queue {
+	uint8_t *buffer;
+	size_t cap;
+	size_t head;
+	size_t read;
+	size_t tail;
+	int polled;
+	int unread;
+	// polled from buffer since the last grow
+	int pinned;
+	// sequence of messages from 1, a message is moved by grow_queue() if seq <= grown
+	uint64_t pushed;
+	uint64_t popped;
+	uint64_t grown;
+	// buffers replaced by grow_queue() while they are pinned
+	int retired_n;
+	int retired_cap;
+	uint8_t **retired;
+};
+
+// a cell of the submission ring. seq == pos : free for the producer of pos,
+// seq == pos + 1 : filled for the consumer, see cp_submit()
+struct submit {
+	uint64_t seq;
 	int id;
 	size_t sz;
-	uint8_t buffer[1];
+	char *buffer;
+};
+
+// an ephemeral key of D-H, A = G^a
+struct keypair {
+	uint64_t a;
+	uint64_t A;
+};
+
+#ifdef CONNECTION_THREAD
+// a crypto thread has its own random generator
+struct crypto_worker {
+	struct connection_pool *cp;
+	pthread_t thread;
+	struct random_state random;
 };
+#endif
 
 struct connection_pool {
-	struct connection_handshake ch;
-	int idbase;
-	// id -> connection *
-	struct connection c[MAXSOCKET];
-	// fd -> connection index
-	int fd[FDHASHSIZE];
+	// limit of live connections and slots
+	int maxsocket;
+	int maxslot;
+	int sendcache;
+	int chunksize;
+	int ack;
+	// free slots, reused in fifo order to keep stale ids away as long as possible
+	int free_head;
+	int free_tail;
+	// slot -> connection *, see get_slot()
+	int slots;
+	int segment_cap;
+	struct connection **segment;
+	struct connection_cold **cold;
+	// fd -> connection slot or handshake, grows on demand
+	int fdcap;
+	struct fdslot *fd;
+	// handshakes are preallocated, see handshake_getfd()
+	int maxhandshake;
+	int handshake_free;
+	struct handshake *handshake;
+	// replay cache pages shared by all the connections, see get_page()
+	int pagesize;
+	int pagechunks;
+	size_t pagebytes;
+	int pages;
+	int page_used;
+	int page_free;
+	int pageblock_cap;
+	char **pageblock;
+	// fingerprint -> node (page index * pagechunks + checkpoint index), chained by fpnext
+	int fphashsize;
+	int fpcount;
+	int *fphash;
+
+	struct queue in;
+	struct queue out;
+
+	// timing wheel, see cp_timeout()
+	int handshake_timeout;
+	int detached_timeout;
+	int tick_init;
+	uint32_t tick;
+	uint32_t time;
+	int timer[TIME_BUCKETS];
+
+	// memory limit, see limit_memory()
+	size_t memory;
+	int live;
+	int lru_head;
+	int lru_tail;
+
+	// callback mode, see dispatch_message()
+	int callback;
+	int dispatching;
+	void (*on_data)(void *ud, int id, const char *buffer, size_t sz);
+	void (*on_write)(void *ud, int fd, const char *buffer, size_t sz);
+	void (*on_close)(void *ud, int fd);
+	void (*on_evict)(void *ud, int id);
+	void (*on_window)(void *ud, int id);
+	void *ud;
+
+	// ids whose window reopened, polled after the in messages. see reopen_window()
+	int reopen_n;
+	int reopen_read;
+	int reopen_cap;
+	int *reopen;
+
+	// bounded mpsc ring of cp_submit, enqueue is shared by the producers. see submit_message()
+	int submit_cap;
+	struct submit *submit;
+	uint64_t enqueue;
+	uint64_t dequeue;
+	int eventfd;	// read end, see cp_submitfd()
+	int eventfd_write;	// the same fd, or the write end of a pipe
+	int signaled;
+
+	// crypto threads, jobs from job_head to job_tail, completions in done
+	int crypto_threads;
+	struct crypto_worker *crypto;
+#ifdef CONNECTION_THREAD
+	pthread_mutex_t crypto_lock;
+	pthread_cond_t crypto_wakeup;
+#endif
+	int crypto_quit;
+	struct crypto_job *job_head;
+	struct crypto_job *job_tail;
+	struct crypto_job *done;
+
+	// precomputed keys for new handshakes, refilled in cp_timeout
+	int keypair_cap;
+	int keypairs;
+	struct keypair *keypair;
+
+	// keys and challenges of handshakes
+	struct random_state random;
+};
 
-	struct message *in_head;
-	struct message *in_tail;
 
-	struct message *out_head;
-	struct message *out_tail;
+static void
+queue_init(struct queue *q) {
+	q->buffer = malloc(QUEUESIZE);
+	q->cap = QUEUESIZE;
+	q->head = 0;
+	q->read = 0;
+	q->tail = 0;
+	q->polled = 0;
+	q->unread = 0;
+	q->pinned = 0;
+	q->pushed = 0;
+	q->popped = 0;
+	q->grown = 0;
+	q->retired_n = 0;
+	q->retired_cap = 0;
+	q->retired = NULL;
+}
 
-	struct message *temp;
-};
+static void
+queue_free_retired(struct queue *q) {
+	int i;
+	for (i=0;i<q->retired_n;i++) {
+		free(q->retired[i]);
+	}
+	q->retired_n = 0;
+}
+
+static void
+queue_exit(struct queue *q) {
+	queue_free_retired(q);
+	free(q->retired);
+	free(q->buffer);
+}
+
+static inline size_t
+message_size(size_t sz) {
+	return (sizeof(struct message) + sz + 7) & ~(size_t)7;
+}
+
+static inline size_t
+record_size(struct message *m) {
+	if (m->sz & MESSAGE_REF)
+		return message_size(sizeof(struct message_ref));
+	return message_size(m->sz);
+}
+
+// the message at offset, skip the wrap mark
+static inline struct message *
+queue_message(struct queue *q, size_t *offset) {
+	struct message *m = (struct message *)(q->buffer + *offset);
+	if (*offset == q->cap || m->sz == MESSAGE_WRAP) {
+		*offset = 0;
+		m = (struct message *)q->buffer;
+	}
+	return m;
+}
+
+// move all the messages to a larger buffer, the old one is kept while it's pinned
+static void
+grow_queue(struct queue *q, size_t need) {
+	size_t cap = q->cap * 2;
+	while (cap < q->cap + need)
+		cap *= 2;
+	uint8_t *buffer = malloc(cap);
+	size_t offset = q->head;
+	size_t tail = 0;
+	int i;
+	for (i=0;i<q->polled + q->unread;i++) {
+		if (i == q->polled) {
+			q->read = tail;
+		}
+		struct message *m = queue_message(q, &offset);
+		size_t sz = record_size(m);
+		memcpy(buffer + tail, m, sz);
+		offset += sz;
+		tail += sz;
+	}
+	if (q->unread == 0) {
+		q->read = tail;
+	}
+	if (q->pinned > 0) {
+		if (q->retired_n >= q->retired_cap) {
+			q->retired_cap = q->retired_cap * 2 + 1;
+			q->retired = realloc(q->retired, q->retired_cap * sizeof(uint8_t *));
+		}
+		q->retired[q->retired_n++] = q->buffer;
+		q->pinned = 0;
+	} else {
+		free(q->buffer);
+	}
+	q->buffer = buffer;
+	q->cap = cap;
+	q->head = 0;
+	q->tail = tail;
+	q->grown = q->pushed;
+}
+
+static struct message *
+queue_push(struct queue *q, int id, size_t sz) {
+	size_t need = message_size(sz);
+	if (q->polled + q->unread == 0) {
+		q->head = q->read = q->tail = 0;
+	}
+	if (q->tail > q->head || q->polled + q->unread == 0) {
+		if (q->cap - q->tail < need) {
+			if (q->head >= need) {
+				if (q->tail < q->cap) {
+					((struct message *)(q->buffer + q->tail))->sz = MESSAGE_WRAP;
+				}
+				q->tail = 0;
+			} else {
+				grow_queue(q, need);
+			}
+		}
+	} else if (q->head - q->tail < need) {
+		grow_queue(q, need);
+	}
+	struct message *m = (struct message *)(q->buffer + q->tail);
+	m->id = id;
+	m->sz = (uint32_t)sz;
+	q->tail += need;
+	++q->unread;
+	++q->pushed;
+	return m;
+}
 
+// shrink the last pushed message to sz bytes, drop it if sz is 0
+static void
+queue_shrink(struct queue *q, struct message *m, size_t sz) {
+	size_t pos = (uint8_t *)m - q->buffer;
+	if (sz == 0) {
+		q->tail = pos;
+		--q->unread;
+		--q->pushed;
+	} else {
+		m->sz = (uint32_t)sz;
+		q->tail = pos + message_size(sz);
+	}
+}
 
+// release the polled messages
 static void
-ch_init(struct connection_handshake *ch) {
-	memset(ch,0,sizeof(*ch));
+queue_release(struct queue *q) {
+	q->head = q->read;
+	q->polled = 0;
+	q->pinned = 0;
+	if (q->retired_n > 0) {
+		queue_free_retired(q);
+	}
+}
+
+static struct message *
+queue_pop(struct queue *q) {
+	if (q->unread == 0)
+		return NULL;
+	struct message *m = queue_message(q, &q->read);
+	q->read += record_size(m);
+	--q->unread;
+	++q->polled;
+	++q->pinned;
+	++q->popped;
+	return m;
+}
+
+static uint8_t *
+new_inmessage(struct connection_pool *c, int id, size_t sz) {
+	struct message *m = queue_push(&c->in, id, sz);
+	return (uint8_t *)(m+1);
+}
+
+static uint8_t *
+new_outmessage(struct connection_pool *c, int id, size_t sz) {
+	struct message *m = queue_push(&c->out, id, sz);
+	return (uint8_t *)(m+1);
 }
 
+#ifdef CONNECTION_THREAD
+
+// an eventfd on linux, a pipe on the other unix
 static void
-ch_exit(struct connection_handshake *ch) {
+open_event(struct connection_pool *cp) {
+#ifdef __linux__
+	cp->eventfd = cp->eventfd_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+	int fd[2];
+	if (pipe(fd) < 0) {
+		cp->eventfd = cp->eventfd_write = -1;
+		return;
+	}
 	int i;
-	for (i=0;i<FDHASHSIZE;i++) {
-		struct handshake * hs = ch->c[i];
-		while(hs) {
-			struct handshake *tmp = hs->next;
-			free(hs);
-			hs = tmp;
+	for (i=0;i<2;i++) {
+		fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+	}
+	cp->eventfd = fd[0];
+	cp->eventfd_write = fd[1];
+#endif
+}
+
+// wake up the thread waiting on cp_submitfd(), once until the next cp_poll
+static void
+signal_event(struct connection_pool *cp) {
+	if (__atomic_exchange_n(&cp->signaled, 1, __ATOMIC_SEQ_CST) == 0) {
+		uint64_t one = 1;
+		if (write(cp->eventfd_write, &one, sizeof(one)) < 0) {
+			// never overflows, the fd is drained by each cp_poll
 		}
 	}
 }
 
+static void
+clear_event(struct connection_pool *cp) {
+	// clear before draining, so a signal after it is not lost
+	__atomic_store_n(&cp->signaled, 0, __ATOMIC_SEQ_CST);
+	// an eventfd is drained by one read of 8 bytes, a pipe until a short read
+	uint64_t value[8];
+	while (read(cp->eventfd, value, sizeof(value)) == sizeof(value)) {
+	}
+}
+
+static void *
+crypto_thread(void *ud) {
+	struct crypto_worker *w = ud;
+	struct connection_pool *cp = w->cp;
+	pthread_mutex_lock(&cp->crypto_lock);
+	for (;;) {
+		while (cp->job_head == NULL && !cp->crypto_quit) {
+			pthread_cond_wait(&cp->crypto_wakeup, &cp->crypto_lock);
+		}
+		if (cp->crypto_quit)
+			break;
+		struct crypto_job *job = cp->job_head;
+		cp->job_head = job->next;
+		if (cp->job_head == NULL)
+			cp->job_tail = NULL;
+		pthread_mutex_unlock(&cp->crypto_lock);
+
+		if (job->A == 0) {
+			job->a = random_next(&w->random);
+			job->A = powmodg(job->a);
+		}
+		job->secret = powmodp(job->B, job->a);
+
+		pthread_mutex_lock(&cp->crypto_lock);
+		job->next = cp->done;
+		__atomic_store_n(&cp->done, job, __ATOMIC_RELEASE);
+		signal_event(cp);
+	}
+	pthread_mutex_unlock(&cp->crypto_lock);
+	return NULL;
+}
+
+#else
+
+// never called, cp_new_ex rejects submit and crypto
+static void
+signal_event(struct connection_pool *cp) {
+}
+
+#endif
+
+// G^a doesn't depend on the peer, so it's done before the handshake
+static void
+fill_keypair(struct connection_pool *cp) {
+	while (cp->keypairs < cp->keypair_cap) {
+		struct keypair *k = &cp->keypair[cp->keypairs++];
+		k->a = random_next(&cp->random);
+		k->A = powmodg(k->a);
+	}
+}
+
 struct connection_pool *
 cp_new() {
+	return cp_new_ex(NULL);
+}
+
+struct connection_pool *
+cp_new_ex(const struct cp_config *config) {
+	struct cp_config cfg = { MAXSOCKET, 0, FDSIZE, SENDCACHESIZE, FINGERPRINTCHUNKSIZE, PAGESIZE, MAXHANDSHAKE, HANDSHAKETIMEOUT, DETACHEDTIMEOUT };
+	if (config) {
+		cfg.on_data = config->on_data;
+		cfg.on_write = config->on_write;
+		cfg.on_close = config->on_close;
+		cfg.on_evict = config->on_evict;
+		cfg.on_window = config->on_window;
+		cfg.memory = config->memory;
+		cfg.ack = config->ack;
+		cfg.submit = config->submit;
+		cfg.crypto = config->crypto;
+		cfg.keypairs = config->keypairs;
+		cfg.seed = config->seed;
+		cfg.ud = config->ud;
+		if (config->maxsocket > 0)
+			cfg.maxsocket = config->maxsocket;
+		if (config->maxslot > 0)
+			cfg.maxslot = config->maxslot;
+		if (config->fdsize > 0)
+			cfg.fdsize = config->fdsize;
+		if (config->sendcache > 0)
+			cfg.sendcache = config->sendcache;
+		if (config->fingerprint > 0)
+			cfg.fingerprint = config->fingerprint;
+		if (config->pagesize > 0)
+			cfg.pagesize = config->pagesize;
+		if (config->maxhandshake > 0)
+			cfg.maxhandshake = config->maxhandshake;
+		if (config->handshake_timeout > 0)
+			cfg.handshake_timeout = config->handshake_timeout;
+		if (config->detached_timeout > 0)
+			cfg.detached_timeout = config->detached_timeout;
+	}
+	// a fingerprint chunk never crosses pages
+	if (cfg.pagesize % cfg.fingerprint != 0)
+		return NULL;
+#ifndef CONNECTION_THREAD
+	if (cfg.submit > 0 || cfg.crypto > 0)
+		return NULL;
+#endif
+	int limit = (1 << ID_SLOTBITS) - 1;
+	if (cfg.maxslot == 0) {
+		cfg.maxslot = limit;
+	} else if (cfg.maxslot > limit) {
+		return NULL;
+	}
+	if (cfg.maxsocket == 0) {
+		cfg.maxsocket = cfg.maxslot;
+	} else if (cfg.maxsocket > limit) {
+		return NULL;
+	}
 	struct connection_pool * cp = malloc(sizeof(*cp));
-	ch_init(&cp->ch);
-	cp->idbase = 0;
-	cp->in_head = NULL;
-	cp->in_tail = NULL;
-	cp->out_head = NULL;
-	cp->out_tail = NULL;
-	cp->temp = NULL;
+	cp->maxsocket = cfg.maxsocket;
+	cp->maxslot = cfg.maxslot;
+	cp->sendcache = cfg.sendcache;
+	cp->ack = cfg.ack;
+	cp->chunksize = cfg.fingerprint;
+	cp->pagesize = cfg.pagesize;
+	cp->pagechunks = cfg.pagesize / cfg.fingerprint;
+	cp->pagebytes = sizeof(struct page) + cp->pagechunks * (sizeof(uint32_t) + sizeof(int)) + cp->pagesize;
+	cp->pagebytes = (cp->pagebytes + 7) & ~7;
+	cp->pages = 0;
+	cp->page_used = 0;
+	cp->page_free = -1;
+	cp->pageblock_cap = 0;
+	cp->pageblock = NULL;
+	cp->slots = 0;
+	cp->segment_cap = 0;
+	cp->segment = NULL;
+	cp->cold = NULL;
+	cp->fdcap = cfg.fdsize;
+	cp->fd = malloc(cp->fdcap * sizeof(struct fdslot));
+	cp->fphashsize = FPHASHSIZE;
+	cp->fpcount = 0;
+	cp->fphash = malloc(cp->fphashsize * sizeof(int));
+	cp->free_head = -1;
+	cp->free_tail = -1;
+	queue_init(&cp->in);
+	queue_init(&cp->out);
+	cp->callback = cfg.on_data || cfg.on_write || cfg.on_close || cfg.on_evict || cfg.on_window;
+	cp->dispatching = 0;
+	cp->on_data = cfg.on_data;
+	cp->on_write = cfg.on_write;
+	cp->on_close = cfg.on_close;
+	cp->on_evict = cfg.on_evict;
+	cp->on_window = cfg.on_window;
+	cp->ud = cfg.ud;
+	cp->reopen_n = 0;
+	cp->reopen_read = 0;
+	cp->reopen_cap = 0;
+	cp->reopen = NULL;
 	int i;
-	for (i=0;i<MAXSOCKET;i++) {
-		// 0 is invalid id
-		cp->c[i].id = 0;
-	}
-	for (i=0;i<FDHASHSIZE;i++) {
+	for (i=0;i<cp->fdcap;i++) {
 		// -1 is nil index
-		cp->fd[i] = -1;
+		cp->fd[i].connection = -1;
+		cp->fd[i].handshake = -1;
+	}
+	cp->maxhandshake = cfg.maxhandshake;
+	cp->handshake = malloc(cp->maxhandshake * sizeof(struct handshake));
+	for (i=0;i<cp->maxhandshake;i++) {
+		cp->handshake[i].next = i + 1;
+		cp->handshake[i].timer.bucket = -1;
+		cp->handshake[i].serial = 0;
+	}
+	cp->handshake[cp->maxhandshake - 1].next = -1;
+	cp->handshake_free = 0;
+	for (i=0;i<cp->fphashsize;i++) {
+		cp->fphash[i] = -1;
+	}
+	cp->memory = cfg.memory;
+	cp->live = 0;
+	cp->lru_head = -1;
+	cp->lru_tail = -1;
+	if (cfg.submit > 0) {
+		int cap = 1;
+		while (cap < cfg.submit)
+			cap *= 2;
+		cp->submit_cap = cap;
+		cp->submit = malloc(cap * sizeof(struct submit));
+		for (i=0;i<cap;i++) {
+			cp->submit[i].seq = i;
+		}
+	} else {
+		cp->submit_cap = 0;
+		cp->submit = NULL;
+	}
+	cp->enqueue = 0;
+	cp->dequeue = 0;
+	cp->signaled = 0;
+	cp->eventfd = cp->eventfd_write = -1;
+#ifdef CONNECTION_THREAD
+	if (cfg.submit > 0 || cfg.crypto > 0)
+		open_event(cp);
+#endif
+	random_init(&cp->random, cfg.seed);
+	cp->keypair_cap = cfg.keypairs;
+	cp->keypairs = 0;
+	cp->keypair = cfg.keypairs > 0 ? malloc(cfg.keypairs * sizeof(struct keypair)) : NULL;
+	fill_keypair(cp);
+	cp->crypto_threads = cfg.crypto;
+	cp->crypto_quit = 0;
+	cp->job_head = cp->job_tail = NULL;
+	cp->done = NULL;
+	cp->crypto = NULL;
+#ifdef CONNECTION_THREAD
+	if (cfg.crypto > 0) {
+		pthread_mutex_init(&cp->crypto_lock, NULL);
+		pthread_cond_init(&cp->crypto_wakeup, NULL);
+		cp->crypto = malloc(cfg.crypto * sizeof(struct crypto_worker));
+		for (i=0;i<cfg.crypto;i++) {
+			struct crypto_worker *w = &cp->crypto[i];
+			w->cp = cp;
+			random_fork(&cp->random, &w->random);
+			pthread_create(&w->thread, NULL, crypto_thread, w);
+		}
+	}
+#endif
+	cp->handshake_timeout = cfg.handshake_timeout;
+	cp->detached_timeout = cfg.detached_timeout;
+	cp->tick_init = 0;
+	cp->tick = 0;
+	cp->time = 0;
+	for (i=0;i<TIME_BUCKETS;i++) {
+		cp->timer[i] = -1;
 	}
 	return cp;
 }
 
+static inline struct connection *
+get_slot(struct connection_pool *cp, int slot) {
+	return &cp->segment[slot >> SEGMENT_BITS][slot & (SEGMENT_SIZE - 1)];
+}
+
+static inline struct connection_cold *
+get_cold(struct connection_pool *cp, int slot) {
+	return &cp->cold[slot >> SEGMENT_BITS][slot & (SEGMENT_SIZE - 1)];
+}
+
+static inline int
+connection_slot(struct connection *c) {
+	return (c->id & ((1 << ID_SLOTBITS) - 1)) - 1;
+}
+
+static inline struct page *
+get_page(struct connection_pool *cp, int index) {
+	return (struct page *)(cp->pageblock[index >> PAGEBLOCK_BITS] + (index & (PAGEBLOCK_SIZE - 1)) * cp->pagebytes);
+}
+
+static inline uint32_t *
+page_fingerprint(struct page *p) {
+	return (uint32_t *)(p+1);
+}
+
+static inline int *
+page_fpnext(struct connection_pool *cp, struct page *p) {
+	return (int *)(page_fingerprint(p) + cp->pagechunks);
+}
+
+static inline uint8_t *
+page_data(struct connection_pool *cp, struct page *p) {
+	return (uint8_t *)(page_fpnext(cp, p) + cp->pagechunks);
+}
+
+static inline struct timer_node *
+get_timer(struct connection_pool *cp, int node) {
+	if (node & 1)
+		return &get_cold(cp, node >> 1)->timer;
+	return &cp->handshake[node >> 1].timer;
+}
+
 static void
-release_message_queue(struct message * head) {
-	while (head) {
-		struct message * tmp = head->next;
-		free(head);
-		head = tmp;
+timer_link(struct connection_pool *cp, int node, int bucket) {
+	struct timer_node *t = get_timer(cp, node);
+	t->bucket = bucket;
+	t->prev = -1;
+	t->next = cp->timer[bucket];
+	if (t->next >= 0) {
+		get_timer(cp, t->next)->prev = node;
 	}
+	cp->timer[bucket] = node;
 }
 
-static struct message *
-new_message(int id, size_t sz) {
-	struct message * m = malloc(sizeof(*m) -1 + sz);
-	m->id = id;
-	m->sz = sz;
-	m->next = NULL;
+static void
+timer_unlink(struct connection_pool *cp, int node) {
+	struct timer_node *t = get_timer(cp, node);
+	if (t->bucket < 0)
+		return;
+	if (t->prev >= 0) {
+		get_timer(cp, t->prev)->next = t->next;
+	} else {
+		cp->timer[t->bucket] = t->next;
+	}
+	if (t->next >= 0) {
+		get_timer(cp, t->next)->prev = t->prev;
+	}
+	t->bucket = -1;
+}
 
-	return m;
+// near[] if it expires in the current 256 ticks, or the level where expire and time differ
+static void
+timer_place(struct connection_pool *cp, int node) {
+	uint32_t expire = get_timer(cp, node)->expire;
+	uint32_t time = cp->time;
+	int bucket;
+	if ((expire|TIME_NEAR_MASK) == (time|TIME_NEAR_MASK)) {
+		bucket = expire & TIME_NEAR_MASK;
+	} else {
+		uint32_t mask = TIME_NEAR << TIME_LEVEL_SHIFT;
+		int i;
+		for (i=0;i<3;i++) {
+			if ((expire|(mask-1)) == (time|(mask-1)))
+				break;
+			mask <<= TIME_LEVEL_SHIFT;
+		}
+		bucket = TIME_NEAR + i * TIME_LEVEL + ((expire >> (TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK);
+	}
+	timer_link(cp, node, bucket);
 }
 
-static uint8_t *
-new_inmessage(struct connection_pool *c, int id, size_t sz) {
-	struct message *m = new_message(id, sz);
-	if (c->in_tail) {
-		c->in_tail->next = m;
-		c->in_tail = m;
+static void
+timer_add(struct connection_pool *cp, int node, int timeout) {
+	timer_unlink(cp, node);
+	get_timer(cp, node)->expire = cp->time + timeout;
+	timer_place(cp, node);
+}
+
+// a connection without fd waits for resume until it expires or it's evicted
+static void
+detach_connection(struct connection_pool *cp, int slot) {
+	timer_add(cp, TIMER_CONNECTION(slot), cp->detached_timeout);
+	struct connection_cold *k = get_cold(cp, slot);
+	k->lru_next = -1;
+	k->lru_prev = cp->lru_tail;
+	if (cp->lru_tail >= 0) {
+		get_cold(cp, cp->lru_tail)->lru_next = slot;
 	} else {
-		c->in_head = c->in_tail = m;
+		cp->lru_head = slot;
 	}
-	return m->buffer;
+	cp->lru_tail = slot;
 }
 
-static uint8_t *
-new_outmessage(struct connection_pool *c, int id, size_t sz) {
-	struct message *m = new_message(id, sz);
-	if (c->out_tail) {
-		c->out_tail->next = m;
-		c->out_tail = m;
+static void
+attach_connection(struct connection_pool *cp, int slot) {
+	timer_unlink(cp, TIMER_CONNECTION(slot));
+	struct connection_cold *k = get_cold(cp, slot);
+	if (k->lru_prev == LRU_NONE)
+		return;
+	if (k->lru_prev >= 0) {
+		get_cold(cp, k->lru_prev)->lru_next = k->lru_next;
+	} else {
+		cp->lru_head = k->lru_next;
+	}
+	if (k->lru_next >= 0) {
+		get_cold(cp, k->lru_next)->lru_prev = k->lru_prev;
 	} else {
-		c->out_head = c->out_tail = m;
+		cp->lru_tail = k->lru_prev;
 	}
-	return m->buffer;
+	k->lru_prev = LRU_NONE;
 }
 
 void
@@ -157,39 +900,93 @@ cp_delete(struct connection_pool * cp) {
 	// todo : add cp_close to close all fd
 	if (cp == NULL)
 		return;
-	release_message_queue(cp->in_head);
-	release_message_queue(cp->out_head);
-	free(cp->temp);
+#ifdef CONNECTION_THREAD
+	if (cp->crypto) {
+		pthread_mutex_lock(&cp->crypto_lock);
+		cp->crypto_quit = 1;
+		pthread_cond_broadcast(&cp->crypto_wakeup);
+		pthread_mutex_unlock(&cp->crypto_lock);
+		int i;
+		for (i=0;i<cp->crypto_threads;i++) {
+			pthread_join(cp->crypto[i].thread, NULL);
+		}
+		free(cp->crypto);
+		pthread_mutex_destroy(&cp->crypto_lock);
+		pthread_cond_destroy(&cp->crypto_wakeup);
+	}
+#endif
+	queue_exit(&cp->in);
+	queue_exit(&cp->out);
+	free(cp->reopen);
 
-	ch_exit(&cp->ch);
+	free(cp->handshake);
+	int i;
+	for (i=0;i<cp->pages / PAGEBLOCK_SIZE;i++) {
+		free(cp->pageblock[i]);
+	}
+	free(cp->pageblock);
+	for (i=0;i<cp->slots / SEGMENT_SIZE;i++) {
+		free(cp->segment[i]);
+		free(cp->cold[i]);
+	}
+	free(cp->segment);
+	free(cp->cold);
+	free(cp->fd);
+	free(cp->fphash);
+	free(cp->keypair);
+	if (cp->submit) {
+		// submitted but not sent
+		while (cp->submit[cp->dequeue & (cp->submit_cap - 1)].seq == cp->dequeue + 1) {
+			free(cp->submit[cp->dequeue++ & (cp->submit_cap - 1)].buffer);
+		}
+		free(cp->submit);
+	}
+#ifdef CONNECTION_THREAD
+	if (cp->eventfd >= 0)
+		close(cp->eventfd);
+	if (cp->eventfd_write != cp->eventfd)
+		close(cp->eventfd_write);
+#endif
+	free(cp);
 }
 
 static struct connection *
 find_by_id(struct connection_pool *cp, uint32_t id) {
-	if (id == 0)
+	int slot = (id & ((1 << ID_SLOTBITS) - 1)) - 1;
+	if (slot < 0 || slot >= cp->slots)
 		return NULL;
-	int slot = id % MAXSOCKET;
-	struct connection * c = &cp->c[slot];
+	struct connection * c = get_slot(cp, slot);
 	if (c->id == id) {
 		return c;
 	}
 	return NULL;
 }
 
+static struct fdslot *
+get_fd(struct connection_pool *cp, int fd) {
+	if (fd >= cp->fdcap) {
+		int cap = cp->fdcap * 2;
+		while (fd >= cap)
+			cap *= 2;
+		cp->fd = realloc(cp->fd, cap * sizeof(struct fdslot));
+		int i;
+		for (i=cp->fdcap;i<cap;i++) {
+			cp->fd[i].connection = -1;
+			cp->fd[i].handshake = -1;
+		}
+		cp->fdcap = cap;
+	}
+	return &cp->fd[fd];
+}
+
 static struct connection *
 find_by_fd(struct connection_pool *cp, int fd) {
-	if (fd < 0)
+	if (fd < 0 || fd >= cp->fdcap)
 		return NULL;
-	int slot = fd % FDHASHSIZE;
-	int index = cp->fd[slot];
-	while(index >= 0) {
-		struct connection *c = &cp->c[index];
-		if (c->fd == fd) {
-			return c;
-		}
-		index = c->next;
-	}
-	return NULL;
+	int slot = cp->fd[fd].connection;
+	if (slot < 0)
+		return NULL;
+	return get_slot(cp, slot);
 }
 
 static void
@@ -198,135 +995,383 @@ remove_fd(struct connection_pool *cp, struct connection *c) {
 	if (fd < 0)
 		return;
 	c->fd = -1;
-	fd %= FDHASHSIZE;
-	int index = cp->fd[fd];
-	struct connection *tmp = &cp->c[index];
-	if (c == tmp) {
-		cp->fd[fd] = tmp->next;
-		tmp->next = -1;
+	int slot = connection_slot(c);
+	assert(cp->fd[fd].connection == slot);
+	cp->fd[fd].connection = -1;
+	detach_connection(cp, slot);
+}
+
+static void
+insert_fd(struct connection_pool *cp, struct connection *c) {
+	int fd = c->fd;
+	assert(fd >= 0);
+	struct fdslot *s = get_fd(cp, fd);
+	if (s->connection >= 0) {
+		// the old owner of fd missed its close
+		get_slot(cp, s->connection)->fd = -1;
+		detach_connection(cp, s->connection);
+	}
+	s->connection = connection_slot(c);
+	attach_connection(cp, s->connection);
+}
+
+static void
+fp_rehash(struct connection_pool *cp) {
+	free(cp->fphash);
+	cp->fphashsize *= 2;
+	cp->fphash = malloc(cp->fphashsize * sizeof(int));
+	int i,j;
+	for (i=0;i<cp->fphashsize;i++) {
+		cp->fphash[i] = -1;
+	}
+	for (i=0;i<cp->pages;i++) {
+		struct page *p = get_page(cp, i);
+		if (p->owner < 0)
+			continue;
+		uint32_t *fingerprint = page_fingerprint(p);
+		int *fpnext = page_fpnext(cp, p);
+		for (j=0;j<cp->pagechunks;j++) {
+			if (fpnext[j] != FP_NONE) {
+				int *bucket = &cp->fphash[fingerprint[j] & (cp->fphashsize - 1)];
+				fpnext[j] = *bucket;
+				*bucket = i * cp->pagechunks + j;
+			}
+		}
+	}
+}
+
+static void
+fp_insert(struct connection_pool *cp, int page, int index) {
+	struct page *p = get_page(cp, page);
+	int *fpnext = page_fpnext(cp, p);
+	assert(fpnext[index] == FP_NONE);
+	int *bucket = &cp->fphash[page_fingerprint(p)[index] & (cp->fphashsize - 1)];
+	fpnext[index] = *bucket;
+	*bucket = page * cp->pagechunks + index;
+	if (++cp->fpcount > cp->fphashsize * 2) {
+		fp_rehash(cp);
+	}
+}
+
+static void
+fp_remove(struct connection_pool *cp, int page, int index) {
+	struct page *p = get_page(cp, page);
+	int *fpnext = page_fpnext(cp, p);
+	if (fpnext[index] == FP_NONE)
 		return;
+	int node = page * cp->pagechunks + index;
+	int *prev = &cp->fphash[page_fingerprint(p)[index] & (cp->fphashsize - 1)];
+	while (*prev != node) {
+		assert(*prev >= 0);
+		prev = &page_fpnext(cp, get_page(cp, *prev / cp->pagechunks))[*prev % cp->pagechunks];
+	}
+	*prev = fpnext[index];
+	fpnext[index] = FP_NONE;
+	--cp->fpcount;
+}
+
+// add a block of free pages, return 0 when the limit is reached
+static int
+grow_page(struct connection_pool *cp) {
+	// fingerprint index node must fit in an int
+	if (cp->pages > INT_MAX / cp->pagechunks - PAGEBLOCK_SIZE)
+		return 0;
+	int index = cp->pages / PAGEBLOCK_SIZE;
+	if (index >= cp->pageblock_cap) {
+		cp->pageblock_cap = cp->pageblock_cap == 0 ? 16 : cp->pageblock_cap * 2;
+		cp->pageblock = realloc(cp->pageblock, cp->pageblock_cap * sizeof(char *));
+	}
+	cp->pageblock[index] = malloc(PAGEBLOCK_SIZE * cp->pagebytes);
+	int i;
+	for (i=0;i<PAGEBLOCK_SIZE;i++) {
+		struct page *p = get_page(cp, cp->pages + i);
+		p->owner = -1;
+		p->pin = 0;
+		p->next = cp->pages + i + 1;
 	}
-	while (tmp->next >= 0) {
-		struct connection *next = &cp->c[tmp->next];
-		if (c == next) {
-			tmp->next = c->next;
-			c->next = -1;
+	get_page(cp, cp->pages + PAGEBLOCK_SIZE - 1)->next = cp->page_free;
+	cp->page_free = cp->pages;
+	cp->pages += PAGEBLOCK_SIZE;
+	return 1;
+}
+
+// make sure n pages are free, so new_page() can't fail
+static int
+reserve_page(struct connection_pool *cp, int n) {
+	while (cp->pages - cp->page_used < n) {
+		if (!grow_page(cp))
+			return 0;
+	}
+	return 1;
+}
+
+// append a page at offset to the replay cache of c, see reserve_page()
+static struct page *
+new_page(struct connection_pool *cp, struct connection *c, uint64_t offset) {
+	assert(cp->page_free >= 0);
+	int index = cp->page_free;
+	struct page *p = get_page(cp, index);
+	cp->page_free = p->next;
+	++cp->page_used;
+	p->next = -1;
+	p->owner = connection_slot(c);
+	p->offset = offset;
+	int *fpnext = page_fpnext(cp, p);
+	int i;
+	for (i=0;i<cp->pagechunks;i++) {
+		fpnext[i] = FP_NONE;
+	}
+	if (c->tail < 0) {
+		c->head = c->tail = index;
+	} else {
+		get_page(cp, c->tail)->next = index;
+		c->tail = index;
+	}
+	return p;
+}
+
+// remove the head page from the replay cache of c
+static void
+release_page(struct connection_pool *cp, struct connection *c) {
+	int index = c->head;
+	struct page *p = get_page(cp, index);
+	int i;
+	for (i=0;i<cp->pagechunks;i++) {
+		fp_remove(cp, index, i);
+	}
+	c->head = p->next;
+	if (c->head < 0) {
+		c->tail = -1;
+	}
+	p->owner = -1;
+	if (p->pin == 0) {
+		p->next = cp->page_free;
+		cp->page_free = index;
+		--cp->page_used;
+	}
+}
+
+// the page is free when it's released by the owner and all the messages are polled
+static void
+unpin_page(struct connection_pool *cp, int index) {
+	struct page *p = get_page(cp, index);
+	if (--p->pin == 0 && p->owner < 0) {
+		p->next = cp->page_free;
+		cp->page_free = index;
+		--cp->page_used;
+	}
+}
+
+// drop the pages out of the replay window, the tail page is always kept.
+// in ack mode the window starts at the acked sendcount
+static void
+trim_page(struct connection_pool *cp, struct connection *c) {
+	uint64_t window;
+	if (cp->ack) {
+		window = get_cold(cp, connection_slot(c))->acked;
+	} else {
+		if (c->sendcount <= cp->sendcache)
+			return;
+		window = c->sendcount - cp->sendcache;
+	}
+	while (c->head != c->tail && get_page(cp, c->head)->offset + cp->pagesize <= window) {
+		release_page(cp, c);
+	}
+}
+
+// queue sz bytes of the page from offset to c->fd, the page is pinned until it's polled.
+// append to the last out message of c if it's not polled and the data is contiguous,
+// so many cp_send become one write
+static void
+new_refmessage(struct connection_pool *cp, struct connection *c, int page, int offset, size_t sz) {
+	struct queue *q = &cp->out;
+	struct connection_cold *k = get_cold(cp, connection_slot(c));
+	if (k->outseq > q->popped && k->outseq > q->grown) {
+		struct message *m = (struct message *)(q->buffer + k->outpos);
+		struct message_ref *ref = (struct message_ref *)(m+1);
+		if (m->id == c->fd && ref->page == page && ref->offset + (m->sz & ~MESSAGE_REF) == offset) {
+			m->sz += (uint32_t)sz;
 			return;
 		}
-		tmp = next;
 	}
-	assert(0);
+	struct message *m = queue_push(q, c->fd, sizeof(struct message_ref));
+	m->sz = (uint32_t)sz | MESSAGE_REF;
+	struct message_ref *ref = (struct message_ref *)(m+1);
+	ref->page = page;
+	ref->offset = offset;
+	++get_page(cp, page)->pin;
+	k->outseq = q->pushed;
+	k->outpos = (uint8_t *)m - q->buffer;
 }
 
+// ack mode : once the refused message fits, cp_poll returns POOL_WINDOW of c, then it can be sent again
 static void
-insert_fd(struct connection_pool *cp, struct connection *c) {
-	int fd = c->fd;
-	assert(fd >= 0);
-	fd %= FDHASHSIZE;
-	c->next = cp->fd[fd];
-	int index = c->id % MAXSOCKET;
-	assert(index == c - cp->c);
-	cp->fd[fd] = index;
+reopen_window(struct connection_pool *cp, struct connection *c) {
+	struct connection_cold *k = get_cold(cp, connection_slot(c));
+	if (k->blocked == 0 || c->sendcount + k->blocked - k->acked > cp->sendcache)
+		return;
+	k->blocked = 0;
+	if (cp->reopen_n >= cp->reopen_cap) {
+		cp->reopen_cap = cp->reopen_cap * 2 + 16;
+		cp->reopen = realloc(cp->reopen, cp->reopen_cap * sizeof(int));
+	}
+	cp->reopen[cp->reopen_n++] = c->id;
 }
 
 static struct connection *
 match_connection(struct connection_pool *cp, struct handshake *hs) {
 	struct connection * c= find_by_id(cp, hs->id);
-	assert(c);
+	if (c == NULL) {
+		// closed during handshake
+		return NULL;
+	}
+	uint64_t offset = hs->request;
+	if (offset < get_page(cp, c->head)->offset) {
+		// sent more during handshake, and dropped out of the cache
+		return NULL;
+	}
 	remove_fd(cp, c);
 	c->fd = hs->fd;
 	insert_fd(cp, c);
+	struct connection_cold *k = get_cold(cp, connection_slot(c));
+	// out messages after the handshake reply
+	k->outseq = 0;
+	// the client has received the bytes before the request
+	if (offset > k->acked) {
+		k->acked = offset;
+		reopen_window(cp, c);
+	}
 
-	uint32_t bytes = (uint32_t)(c->sendcount - hs->request);
-	assert(bytes <= SENDCACHESIZE);
-	
-	if (bytes > 0) {
-		uint8_t * buffer = new_outmessage(cp, c->id, bytes);
-		uint32_t ptr = (uint32_t)(c->sendcount % SENDCACHESIZE);
-		if (bytes <= ptr) {
-			memcpy(buffer, c->sendbuffer + ptr-bytes, bytes);
-		} else {
-			int s = bytes - ptr;
-			memcpy(buffer, c->sendbuffer + SENDCACHESIZE - s, s);
-			memcpy(buffer + s, c->sendbuffer + s, bytes - s);
+	size_t bytes = (size_t)(c->sendcount - offset);
+	int index = c->head;
+	while (bytes > 0) {
+		struct page *p = get_page(cp, index);
+		uint64_t end = p->offset + cp->pagesize;
+		if (offset < end) {
+			size_t n = (size_t)(end - offset);
+			if (n > bytes)
+				n = bytes;
+			new_refmessage(cp, c, index, (int)(offset - p->offset), n);
+			offset += n;
+			bytes -= n;
 		}
+		index = p->next;
 	}
 
 	return c;
 }
 
+// add a segment of free slots, return 0 when the limit is reached
+static int
+grow_connection(struct connection_pool *cp) {
+	int n = cp->maxslot - cp->slots;
+	if (n <= 0)
+		return 0;
+	if (n > SEGMENT_SIZE)
+		n = SEGMENT_SIZE;
+	int index = cp->slots / SEGMENT_SIZE;
+	if (index >= cp->segment_cap) {
+		cp->segment_cap = cp->segment_cap == 0 ? 16 : cp->segment_cap * 2;
+		cp->segment = realloc(cp->segment, cp->segment_cap * sizeof(struct connection *));
+		cp->cold = realloc(cp->cold, cp->segment_cap * sizeof(struct connection_cold *));
+	}
+	struct connection *seg = malloc(SEGMENT_SIZE * sizeof(struct connection));
+	cp->segment[index] = seg;
+	cp->cold[index] = malloc(SEGMENT_SIZE * sizeof(struct connection_cold));
+	int i;
+	for (i=0;i<SEGMENT_SIZE;i++) {
+		// 0 is invalid id
+		seg[i].id = 0;
+		seg[i].version = 0;
+		seg[i].next = cp->slots + i + 1;
+		seg[i].head = -1;
+		seg[i].tail = -1;
+	}
+	// slots beyond the limit are never linked into the free list
+	seg[n-1].next = -1;
+	assert(cp->free_head < 0);
+	cp->free_head = cp->slots;
+	cp->free_tail = cp->slots + n - 1;
+	cp->slots += SEGMENT_SIZE;
+	return 1;
+}
+
 static struct connection *
 new_connection(struct connection_pool *cp, struct handshake *hs) {
-	int i;
-	for (i=0;i<MAXSOCKET;i++) {
-		uint32_t id = ++cp->idbase;
-		if (id == 0) {
-			id = ++cp->idbase;
-		}
-		int slot = id % MAXSOCKET;
-		struct connection * c = &cp->c[slot];
-		if (c->id == 0) {
-			c->id = id;
-			c->fd = hs->fd;
-			insert_fd(cp, c);
-			c->secret = hs->secret;
-			c->recvcount = 0;
-			c->sendcount = 0;
-			c->fingerprint[0] = rc4_init(&c->sendbox, c->secret);
-			rc4_init(&c->recvbox, c->secret);
-
-			return c;
-		}
+	if (cp->live >= cp->maxsocket || !reserve_page(cp, 1))
+		return NULL;
+	if (cp->free_head < 0 && !grow_connection(cp))
+		return NULL;
+	int slot = cp->free_head;
+	struct connection * c = get_slot(cp, slot);
+	cp->free_head = c->next;
+	if (cp->free_head < 0) {
+		cp->free_tail = -1;
 	}
-	return NULL;
+	c->id = (uint32_t)c->version << ID_SLOTBITS | (slot + 1);
+	c->version = (c->version + 1) % ID_VERSIONS;
+	struct connection_cold *k = get_cold(cp, slot);
+	k->timer.bucket = -1;
+	k->lru_prev = LRU_NONE;
+	++cp->live;
+	c->fd = hs->fd;
+	insert_fd(cp, c);
+	c->recvcount = 0;
+	c->sendcount = 0;
+	k->secret = hs->secret;
+	k->outseq = 0;
+	k->acked = 0;
+	k->remain = 0;
+	k->framesz = 0;
+	k->blocked = 0;
+	struct page *p = new_page(cp, c, 0);
+	page_fingerprint(p)[0] = rc4_init(&k->sendbox, k->secret);
+	fp_insert(cp, c->tail, 0);
+	rc4_init(&k->recvbox, k->secret);
+
+	return c;
 }
 
+// return NULL if fd is rejected
 static struct handshake *
-handshake_newfd(struct connection_handshake *ch,int fd) {
-	int slot = fd % FDHASHSIZE;
-	struct handshake * hs = malloc(sizeof(*hs));
+handshake_getfd(struct connection_pool *cp, int fd) {
+	struct fdslot *s = get_fd(cp, fd);
+	if (s->handshake >= 0)
+		return &cp->handshake[s->handshake];
+	if (s->handshake == HANDSHAKE_CLOSING)
+		return NULL;
+	int index = cp->handshake_free;
+	if (index < 0) {
+		// too many handshakes in progress
+		s->handshake = HANDSHAKE_CLOSING;
+		new_outmessage(cp, fd, 0);
+		return NULL;
+	}
+	struct handshake * hs = &cp->handshake[index];
+	cp->handshake_free = hs->next;
 	hs->id = 0;
 	hs->closed = 0;
+	hs->pending = 0;
+	++hs->serial;
 	hs->fd = fd;
-	hs->version = ch->version;
 	hs->sz = 0;
-	hs->next = ch->c[slot];
-
-	ch->c[slot] = hs;
+	s->handshake = index;
+	timer_add(cp, TIMER_HANDSHAKE(index), cp->handshake_timeout);
 
 	return hs;
 }
 
-static struct handshake *
-handshake_getfd(struct connection_handshake *ch, int fd) {
-	int slot = fd % FDHASHSIZE;
-	struct handshake * c = ch->c[slot];
-	while (c) {
-		if (c->fd == fd)
-			return c;
-		c = c->next;
-	}
-	return handshake_newfd(ch, fd);
-}
-
 static void
-handshake_delete(struct connection_handshake *ch, struct handshake *hs) {
-	int slot = hs->fd % FDHASHSIZE;
-	struct handshake *t = ch->c[slot];
-	if (t == hs) {
-		ch->c[slot] = hs->next;
-		free(hs);
+handshake_delete(struct connection_pool *cp, struct handshake *hs) {
+	timer_unlink(cp, TIMER_HANDSHAKE(hs - cp->handshake));
+	cp->fd[hs->fd].handshake = -1;
+	if (hs->pending) {
+		// the job is still used by a crypto thread, crypto_message() frees it
+		hs->fd = -1;
 		return;
 	}
-	while (t->next) {
-		if (t->next == hs) {
-			t->next = hs->next;
-			free(hs);
-			return;
-		}
-		t=t->next;
-	}
-	assert(0);
+	hs->next = cp->handshake_free;
+	cp->handshake_free = hs - cp->handshake;
 }
 
 static uint32_t
@@ -357,9 +1402,19 @@ static void
 handshake_kick(struct connection_pool *cp, struct handshake *hs) {
 	assert(hs->closed == 0);
 	hs->closed = 1;
+	timer_unlink(cp, TIMER_HANDSHAKE(hs - cp->handshake));
 	new_outmessage(cp, hs->fd, 0);
 }
 
+// the connection to resume is gone, tell the client before close
+static void
+handshake_reset(struct connection_pool *cp, struct handshake *hs) {
+	uint8_t *outbuffer = new_outmessage(cp, hs->fd, 16);
+	uint64le(outbuffer, HANDSHAKE_RESET);
+	uint64le(outbuffer+8, 0);
+	handshake_kick(cp, hs);
+}
+
 static int
 handshake_auth(struct connection_pool *cp, struct handshake *hs, const uint8_t *buffer, size_t sz, int offset) {
 	int need = offset + 8 - hs->sz;
@@ -382,6 +1437,34 @@ handshake_auth(struct connection_pool *cp, struct handshake *hs, const uint8_t *
 	}
 }
 
+#ifdef CONNECTION_THREAD
+// the reply is queued by crypto_message() in cp_poll
+static void
+crypto_post(struct connection_pool *cp, struct handshake *hs, uint64_t B) {
+	struct crypto_job *job = &hs->job;
+	job->next = NULL;
+	job->index = hs - cp->handshake;
+	job->serial = hs->serial;
+	job->B = B;
+	job->A = 0;
+	if (cp->keypairs > 0) {
+		struct keypair *k = &cp->keypair[--cp->keypairs];
+		job->a = k->a;
+		job->A = k->A;
+	}
+	hs->pending = 1;
+	pthread_mutex_lock(&cp->crypto_lock);
+	if (cp->job_tail) {
+		cp->job_tail->next = job;
+	} else {
+		cp->job_head = job;
+	}
+	cp->job_tail = job;
+	pthread_cond_signal(&cp->crypto_wakeup);
+	pthread_mutex_unlock(&cp->crypto_lock);
+}
+#endif
+
 static int
 handshake_new(struct connection_pool *cp, struct handshake *hs, const uint8_t *buffer, size_t sz) {
 	if (hs->sz < 16) {
@@ -394,7 +1477,7 @@ handshake_new(struct connection_pool *cp, struct handshake *hs, const uint8_t *b
 		}
 		if (sz < need) {
 			memcpy(hs->buffer + hs->sz, buffer, sz);
-			hs->sz += hs->sz;
+			hs->sz += sz;
 			return 0;
 		}
 		memcpy(hs->buffer + hs->sz, buffer, need);
@@ -410,10 +1493,23 @@ handshake_new(struct connection_pool *cp, struct handshake *hs, const uint8_t *b
 		if (B == 0) {
 			B = 1;	// B can never be zero unless be attack.
 		}
-		uint64_t a = randomint64();
-		uint64_t A = powmodp(G, a);
+#ifdef CONNECTION_THREAD
+		if (cp->crypto) {
+			crypto_post(cp, hs, B);
+			return 0;
+		}
+#endif
+		uint64_t a, A;
+		if (cp->keypairs > 0) {
+			struct keypair *k = &cp->keypair[--cp->keypairs];
+			a = k->a;
+			A = k->A;
+		} else {
+			a = random_next(&cp->random);
+			A = powmodg(a);
+		}
 		hs->secret = powmodp(B,a);
-		hs->challenge = randomint64();
+		hs->challenge = random_next(&cp->random);
 
 		uint8_t *outbuffer = new_outmessage(cp, hs->fd, 16);
 		uint64le(outbuffer,A);
@@ -421,22 +1517,28 @@ handshake_new(struct connection_pool *cp, struct handshake *hs, const uint8_t *b
 
 		return 0;
 	}
+	if (hs->pending) {
+		// the client can't auth before the reply
+		handshake_kick(cp, hs);
+		return 0;
+	}
 	
 	return handshake_auth(cp, hs, buffer, sz, 16);
 }
 
 static struct connection *
 connection_match(struct connection_pool *cp, uint64_t request_count, uint32_t fingerprint) {
-	int i;
-	for (i=0;i<MAXSOCKET;i++) {
-		struct connection *c = &cp->c[i];
-		if (c->id == 0)
-			continue;
-		if (request_count > c->sendcount || request_count + SENDCACHESIZE < c->sendcount)
-			continue;
-		int index = request_count % SENDCACHESIZE / FINGERPRINTCHUNKSIZE;
-		if (c->fingerprint[index] == fingerprint)
-			return c;
+	uint64_t checkpoint = request_count - request_count % cp->chunksize;
+	int node = cp->fphash[fingerprint & (cp->fphashsize - 1)];
+	while (node >= 0) {
+		struct page *p = get_page(cp, node / cp->pagechunks);
+		int i = node % cp->pagechunks;
+		if (page_fingerprint(p)[i] == fingerprint && p->offset + i * cp->chunksize == checkpoint) {
+			struct connection *c = get_slot(cp, p->owner);
+			if (request_count <= c->sendcount)
+				return c;
+		}
+		node = page_fpnext(cp, p)[i];
 	}
 	return NULL;
 }
@@ -453,7 +1555,7 @@ handshake_reuse(struct connection_pool *cp, struct handshake *hs, const uint8_t
 		}
 		if (sz < need) {
 			memcpy(hs->buffer + hs->sz, buffer, sz);
-			hs->sz += hs->sz;
+			hs->sz += sz;
 			return 0;
 		}
 		memcpy(hs->buffer + hs->sz, buffer, need);
@@ -466,11 +1568,11 @@ handshake_reuse(struct connection_pool *cp, struct handshake *hs, const uint8_t
 		uint32_t fingerprint = leuint32(hs->buffer + 8);
 		struct connection * c = connection_match(cp, hs->request, fingerprint);
 		if (c == NULL) {
-			handshake_kick(cp, hs);
+			handshake_reset(cp, hs);
 		} else {
-			hs->secret = c->secret;
+			hs->secret = get_cold(cp, connection_slot(c))->secret;
 			hs->id = c->id;
-			hs->challenge = randomint64();
+			hs->challenge = random_next(&cp->random);
 
 			uint8_t *outbuffer = new_outmessage(cp, hs->fd, 16);
 			uint64le(outbuffer,c->recvcount);
@@ -499,7 +1601,7 @@ handshake_recv(struct connection_pool *cp, struct handshake *hs, const uint8_t *
 		int need = 8-hs->sz;
 		if (sz < need) {
 			memcpy(hs->buffer + hs->sz, buffer, sz);
-			hs->sz += hs->sz;
+			hs->sz += sz;
 			return 0;
 		}
 		memcpy(hs->buffer + hs->sz, buffer, need);
@@ -515,28 +1617,86 @@ handshake_recv(struct connection_pool *cp, struct handshake *hs, const uint8_t *
 	}
 }
 
-void 
-cp_recv(struct connection_pool *cp, int fd, const char * buffer, size_t sz) {
+// return the connection of fd, NULL if it's in handshake. *n is the bytes used by handshake
+static struct connection *
+recv_connection(struct connection_pool *cp, int fd, const char * buffer, size_t sz, size_t *n) {
+	*n = 0;
 	struct connection *c = find_by_fd(cp, fd);
+	if (c)
+		return c;
+	// handshake
+	struct handshake * hs = handshake_getfd(cp, fd);
+	if (hs == NULL)
+		return NULL;
+	int used = handshake_recv(cp, hs, (const uint8_t *)buffer, sz);
+	if (used == 0) {
+		// handshake not end
+		return NULL;
+	}
+	if (hs->id == 0) {
+		c = new_connection(cp, hs);
+	} else {
+		c = match_connection(cp, hs);
+	}
+	handshake_delete(cp, hs);
 	if (c == NULL) {
-		// handshake
-		struct handshake * hs = handshake_getfd(&cp->ch, fd);
-		int n = handshake_recv(cp, hs, (const uint8_t *)buffer, sz);
-		if (n == 0) {
-			// handshake not end
-			return;
-		}
-		if (hs->id == 0) {
-			c = new_connection(cp, hs);
-		} else {
-			c = match_connection(cp, hs);
+		// connect failed, close handshake
+		cp->fd[fd].handshake = HANDSHAKE_CLOSING;
+		new_outmessage(cp, fd, 0);
+		return NULL;
+	}
+	*n = used;
+	return c;
+}
+
+static void
+recv_ack(struct connection_pool *cp, struct connection *c, uint64_t count) {
+	struct connection_cold *k = get_cold(cp, connection_slot(c));
+	if (count > c->sendcount || count <= k->acked)
+		return;
+	k->acked = count;
+	trim_page(cp, c);
+	reopen_window(cp, c);
+}
+
+// ack mode : strip the frame headers from the plain text in place, returns the bytes of data.
+// a frame is uint32_t size and data, size 0 is followed by uint64_t recvcount of the client
+static size_t
+recv_frame(struct connection_pool *cp, struct connection *c, uint8_t *buffer, size_t sz) {
+	struct connection_cold *k = get_cold(cp, connection_slot(c));
+	size_t i = 0;
+	size_t n = 0;
+	while (i < sz) {
+		if (k->remain > 0) {
+			size_t bytes = sz - i;
+			if (bytes > k->remain)
+				bytes = k->remain;
+			memmove(buffer + n, buffer + i, bytes);
+			n += bytes;
+			i += bytes;
+			k->remain -= bytes;
+			continue;
 		}
-		handshake_delete(&cp->ch, hs);
-		if (c == NULL) {
-			// connect failed, close handshake
-			new_outmessage(cp, c->fd, 0);
-			return;
+		k->frame[k->framesz++] = buffer[i++];
+		if (k->framesz == 4) {
+			k->remain = leuint32(k->frame);
+			if (k->remain > 0)
+				k->framesz = 0;
+		} else if (k->framesz == 12) {
+			k->framesz = 0;
+			recv_ack(cp, c, leuint64(k->frame + 4));
 		}
+	}
+	return n;
+}
+
+static void
+recv_message(struct connection_pool *cp, int fd, const char * buffer, size_t sz) {
+	size_t n;
+	struct connection *c = recv_connection(cp, fd, buffer, sz, &n);
+	if (c == NULL)
+		return;
+	if (n > 0) {
 		sz -= n;
 		if (sz == 0)
 			return;
@@ -546,9 +1706,64 @@ cp_recv(struct connection_pool *cp, int fd, const char * buffer, size_t sz) {
 		// client close fd
 		remove_fd(cp,c);
 	} else {
-		uint8_t * inbuffer = new_inmessage(cp, c->id, sz);
-		rc4_encode(&c->recvbox, (const uint8_t *)buffer, inbuffer, sz);
+		struct message *m = queue_push(&cp->in, c->id, sz);
+		uint8_t * inbuffer = (uint8_t *)(m+1);
+		rc4_decode(&get_cold(cp, connection_slot(c))->recvbox, (const uint8_t *)buffer, inbuffer, sz);
 		c->recvcount += sz;
+		if (cp->ack) {
+			queue_shrink(&cp->in, m, recv_frame(cp, c, inbuffer, sz));
+		}
+	}
+}
+
+static int
+recv_inplace(struct connection_pool *cp, int fd, char * buffer, size_t sz, struct pool_message *m) {
+	size_t n;
+	struct connection *c = recv_connection(cp, fd, buffer, sz, &n);
+	if (c == NULL)
+		return POOL_EMPTY;
+	if (n > 0) {
+		sz -= n;
+		if (sz == 0)
+			return POOL_EMPTY;
+		buffer += n;
+	}
+	if (sz == 0) {
+		// client close fd
+		remove_fd(cp,c);
+		return POOL_EMPTY;
+	}
+	rc4_decode(&get_cold(cp, connection_slot(c))->recvbox, (const uint8_t *)buffer, (uint8_t *)buffer, sz);
+	c->recvcount += sz;
+	if (cp->ack) {
+		sz = recv_frame(cp, c, (uint8_t *)buffer, sz);
+		if (sz == 0)
+			return POOL_EMPTY;
+	}
+	m->type = POOL_IN;
+	m->id = c->id;
+	m->sz = sz;
+	m->buffer = buffer;
+	return POOL_IN;
+}
+
+static void
+free_connection(struct connection_pool *cp, struct connection *c) {
+	while (c->head >= 0) {
+		release_page(cp, c);
+	}
+
+	int slot = connection_slot(c);
+	attach_connection(cp, slot);
+	--cp->live;
+	c->id = 0;
+	c->next = -1;
+	// the slot goes to the tail, so the other free slots are used before its next version
+	if (cp->free_tail < 0) {
+		cp->free_head = cp->free_tail = slot;
+	} else {
+		get_slot(cp, cp->free_tail)->next = slot;
+		cp->free_tail = slot;
 	}
 }
 
@@ -559,76 +1774,110 @@ connection_close(struct connection_pool *cp, struct connection *c) {
 		remove_fd(cp, c);
 		new_outmessage(cp, fd, 0);
 	}
-	c->id = 0;
+	free_connection(cp, c);
 }
 
+// encrypt into the tail page of the replay cache
 static inline uint32_t
-send_bytes(struct connection *c, const char * src, uint8_t *output, int sz) {
-	uint32_t r = rc4_encode(&c->sendbox, (const uint8_t *)src, output, sz);
-	if (output) {
-		int offset = c->sendcount % SENDCACHESIZE;
-		assert(SENDCACHESIZE - offset >= sz);
-		memcpy(c->sendbuffer+offset,output,sz);
-	}
+send_bytes(struct connection_pool *cp, struct connection *c, const char * src, int sz) {
+	struct page *p = get_page(cp, c->tail);
+	int offset = (int)(c->sendcount - p->offset);
+	assert(cp->pagesize - offset >= sz);
+	uint32_t r = rc4_encode(&get_cold(cp, connection_slot(c))->sendbox, (const uint8_t *)src, page_data(cp, p) + offset, sz);
 	c->sendcount += sz;
 	return r;
 }
 
+// queue the ciphertext of the tail page from *start to sendcount
+static void
+send_page(struct connection_pool *cp, struct connection *c, uint64_t *start) {
+	size_t sz = (size_t)(c->sendcount - *start);
+	if (sz == 0)
+		return;
+	struct page *p = get_page(cp, c->tail);
+	new_refmessage(cp, c, c->tail, (int)(*start - p->offset), sz);
+	*start = c->sendcount;
+}
+
 static inline void
-mark_fingerprint(struct connection *c, uint32_t fingerprint) {
-	int index = c->sendcount % SENDCACHESIZE;
-	index /= FINGERPRINTCHUNKSIZE;
-	c->fingerprint[index] = fingerprint;
+mark_fingerprint(struct connection_pool *cp, struct connection *c, uint32_t fingerprint, uint64_t *start) {
+	struct page *p = get_page(cp, c->tail);
+	int offset = (int)(c->sendcount - p->offset);
+	if (offset == cp->pagesize) {
+		send_page(cp, c, start);
+		p = new_page(cp, c, c->sendcount);
+		offset = 0;
+		trim_page(cp, c);
+	}
+	int index = offset / cp->chunksize;
+	page_fingerprint(p)[index] = fingerprint;
+	fp_insert(cp, c->tail, index);
 }
 
-void
-cp_send(struct connection_pool *cp, int id, const char *buffer, size_t sz) {
+static int
+send_message(struct connection_pool *cp, int id, const char *buffer, size_t sz) {
 	struct connection *c = find_by_id(cp, id);
 	if (c == NULL)
-		return;
+		return 0;
 	if (sz == 0) {
 		// close id
 		connection_close(cp, c);
-		return;
+		return 0;
 	}
-	uint8_t * output = NULL;
-	if (c->fd >= 0) {
-		output = new_outmessage(cp, c->fd, sz);
-	} else {
+	if (c->fd < 0) {
 		// remote client closed
-		return;
+		return 0;
+	}
+	if (cp->ack) {
+		if (sz > cp->sendcache) {
+			// never fits in the window
+			return -2;
+		}
+		struct connection_cold *k = get_cold(cp, connection_slot(c));
+		if (c->sendcount + sz - k->acked > cp->sendcache) {
+			// wait for ack, see reopen_window()
+			k->blocked = (uint32_t)sz;
+			return -1;
+		}
 	}
-	int head = c->sendcount % FINGERPRINTCHUNKSIZE;
+	// the pages filled by this message are pinned until they are polled
+	size_t pages = (size_t)(c->sendcount - get_page(cp, c->tail)->offset + sz) / cp->pagesize;
+	if (pages > INT_MAX || !reserve_page(cp, (int)pages)) {
+		// out of the page index
+		return -1;
+	}
+	uint64_t start = c->sendcount;
+	int head = c->sendcount % cp->chunksize;
 	if (head > 0) {
-		head = FINGERPRINTCHUNKSIZE - head;
+		head = cp->chunksize - head;
 		if (head > sz) {
-			send_bytes(c, buffer, output, sz);
-			return;
+			send_bytes(cp, c, buffer, sz);
+			send_page(cp, c, &start);
+			return 0;
 		}
-		uint32_t fingerprint = send_bytes(c, buffer, output, head);
-		mark_fingerprint(c, fingerprint);
+		uint32_t fingerprint = send_bytes(cp, c, buffer, head);
+		mark_fingerprint(cp, c, fingerprint, &start);
 		buffer += head;
 		sz -= head;
-		if (output)
-			output += head;
 	}
-	if (sz <= FINGERPRINTCHUNKSIZE) {
-		uint32_t fingerprint = send_bytes(c, buffer, output, sz);
-		if (sz == FINGERPRINTCHUNKSIZE)
-			mark_fingerprint(c, fingerprint);
-		return;
+	if (sz <= cp->chunksize) {
+		uint32_t fingerprint = send_bytes(cp, c, buffer, sz);
+		if (sz == cp->chunksize)
+			mark_fingerprint(cp, c, fingerprint, &start);
+		send_page(cp, c, &start);
+		return 0;
 	}
 	size_t i;
-	for (i=0;i<sz-FINGERPRINTCHUNKSIZE;i+=FINGERPRINTCHUNKSIZE) {
-		uint32_t fingerprint = send_bytes(c, buffer, output, FINGERPRINTCHUNKSIZE);
-		mark_fingerprint(c, fingerprint);
-		buffer += FINGERPRINTCHUNKSIZE;
-		if (output)
-			output += FINGERPRINTCHUNKSIZE;
+	for (i=0;i<sz-cp->chunksize;i+=cp->chunksize) {
+		uint32_t fingerprint = send_bytes(cp, c, buffer, cp->chunksize);
+		mark_fingerprint(cp, c, fingerprint, &start);
+		buffer += cp->chunksize;
 	}
-	uint32_t fingerprint = send_bytes(c, buffer, output, sz - i);
-	if (sz - i == FINGERPRINTCHUNKSIZE)
-		mark_fingerprint(c, fingerprint);
+	uint32_t fingerprint = send_bytes(cp, c, buffer, sz - i);
+	if (sz - i == cp->chunksize)
+		mark_fingerprint(cp, c, fingerprint, &start);
+	send_page(cp, c, &start);
+	return 0;
 }
 
 static void
@@ -636,51 +1885,418 @@ close_fd(struct connection_pool *cp, int fd) {
 	struct connection *c = find_by_fd(cp, fd);
 	if (c) {
 		remove_fd(cp, c);
-		c->id = 0;
+		free_connection(cp, c);
 		return;
 	}
-	struct handshake *hs = handshake_getfd(&cp->ch, fd);
-	handshake_delete(&cp->ch, hs);
+	if (fd < cp->fdcap) {
+		int index = cp->fd[fd].handshake;
+		if (index >= 0) {
+			handshake_delete(cp, &cp->handshake[index]);
+		} else {
+			cp->fd[fd].handshake = -1;
+		}
+	}
 }
 
 static void
-fill_message(struct connection_pool *c, struct pool_message *m) {
-	m->sz = c->temp->sz;
-	m->id = c->temp->id;
-	if (m->sz == 0) {
+fill_message(struct connection_pool *cp, struct message *msg, struct pool_message *m) {
+	m->id = msg->id;
+	if (msg->sz & MESSAGE_REF) {
+		struct message_ref *ref = (struct message_ref *)(msg+1);
+		m->sz = msg->sz & ~MESSAGE_REF;
+		m->buffer = (const char *)page_data(cp, get_page(cp, ref->page)) + ref->offset;
+	} else if (msg->sz == 0) {
+		m->sz = 0;
 		m->buffer = NULL;
 	} else {
-		m->buffer = (const char *)c->temp->buffer;
+		m->sz = msg->sz;
+		m->buffer = (const char *)(msg+1);
+	}
+}
+
+// unpin the pages referred by polled out messages
+static void
+release_outmessage(struct connection_pool *cp) {
+	struct queue *q = &cp->out;
+	size_t offset = q->head;
+	int i;
+	for (i=0;i<q->polled;i++) {
+		struct message *m = queue_message(q, &offset);
+		if (m->sz & MESSAGE_REF) {
+			unpin_page(cp, ((struct message_ref *)(m+1))->page);
+		}
+		offset += record_size(m);
+	}
+	queue_release(q);
+}
+
+static int
+poll_message(struct connection_pool *c, struct pool_message *m, int n) {
+	release_outmessage(c);
+	queue_release(&c->in);
+	int i = 0;
+	struct message *msg;
+	while (i < n && (msg = queue_pop(&c->out))) {
+		fill_message(c,msg,&m[i]);
+		m[i].type = POOL_OUT;
+		if (m[i].sz == 0) {
+			close_fd(c, m[i].id);
+		}
+		++i;
+	}
+	while (i < n && (msg = queue_pop(&c->in))) {
+		fill_message(c,msg,&m[i]);
+		// no empty data in, see limit_memory()
+		m[i].type = m[i].sz == 0 ? POOL_EVICT : POOL_IN;
+		++i;
+	}
+	while (i < n && c->reopen_read < c->reopen_n) {
+		m[i].type = POOL_WINDOW;
+		m[i].id = c->reopen[c->reopen_read++];
+		m[i].sz = 0;
+		m[i].buffer = NULL;
+		++i;
+	}
+	if (c->reopen_read == c->reopen_n) {
+		c->reopen_read = c->reopen_n = 0;
+	}
+	return i;
+}
+
+static inline size_t
+memory_used(struct connection_pool *cp) {
+	return (size_t)cp->live * (sizeof(struct connection) + sizeof(struct connection_cold))
+		+ (size_t)cp->page_used * cp->pagebytes;
+}
+
+// release the detached connections from the oldest until the memory fits, live ones are kept
+static void
+limit_memory(struct connection_pool *cp) {
+	if (cp->memory == 0)
+		return;
+	while (cp->lru_head >= 0 && memory_used(cp) > cp->memory) {
+		struct connection *c = get_slot(cp, cp->lru_head);
+		new_inmessage(cp, c->id, 0);
+		free_connection(cp, c);
+	}
+}
+
+// callback mode : drain the queues. messages queued by the callbacks are dispatched by the same loop
+static void
+dispatch_message(struct connection_pool *cp) {
+	if (!cp->callback || cp->dispatching)
+		return;
+	cp->dispatching = 1;
+	struct pool_message m;
+	while (poll_message(cp, &m, 1) > 0) {
+		if (m.type == POOL_IN) {
+			if (cp->on_data)
+				cp->on_data(cp->ud, m.id, m.buffer, m.sz);
+		} else if (m.type == POOL_EVICT) {
+			if (cp->on_evict)
+				cp->on_evict(cp->ud, m.id);
+		} else if (m.type == POOL_WINDOW) {
+			if (cp->on_window)
+				cp->on_window(cp->ud, m.id);
+		} else if (m.sz == 0) {
+			if (cp->on_close)
+				cp->on_close(cp->ud, m.id);
+		} else {
+			if (cp->on_write)
+				cp->on_write(cp->ud, m.id, m.buffer, m.sz);
+		}
+	}
+	cp->dispatching = 0;
+}
+
+// send the messages of cp_submit, return the number of messages.
+// a message waiting for ack stays at the head of the ring, and is sent again in the next cp_poll
+static int
+submit_message(struct connection_pool *cp) {
+	if (cp->submit == NULL)
+		return 0;
+	int n = 0;
+	for (;;) {
+		struct submit *s = &cp->submit[cp->dequeue & (cp->submit_cap - 1)];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != cp->dequeue + 1)
+			break;
+		if (send_message(cp, s->id, s->buffer, s->sz) == -1)
+			break;
+		free(s->buffer);
+		__atomic_store_n(&s->seq, cp->dequeue + cp->submit_cap, __ATOMIC_RELEASE);
+		++cp->dequeue;
+		++n;
+	}
+	return n;
+}
+
+#ifdef CONNECTION_THREAD
+// reply the handshakes completed by the crypto threads, return the number of them
+static int
+crypto_message(struct connection_pool *cp) {
+	if (__atomic_load_n(&cp->done, __ATOMIC_ACQUIRE) == NULL)
+		return 0;
+	pthread_mutex_lock(&cp->crypto_lock);
+	struct crypto_job *job = cp->done;
+	cp->done = NULL;
+	pthread_mutex_unlock(&cp->crypto_lock);
+	int n = 0;
+	while (job) {
+		struct crypto_job *next = job->next;
+		struct handshake *hs = &cp->handshake[job->index];
+		assert(hs->pending && hs->serial == job->serial);
+		hs->pending = 0;
+		if (hs->fd < 0) {
+			// deleted while the job was running
+			hs->next = cp->handshake_free;
+			cp->handshake_free = job->index;
+		} else if (!hs->closed) {
+			hs->secret = job->secret;
+			hs->challenge = random_next(&cp->random);
+
+			uint8_t *outbuffer = new_outmessage(cp, hs->fd, 16);
+			uint64le(outbuffer,job->A);
+			uint64le(outbuffer+8,hs->challenge);
+			++n;
+		}
+		job = next;
+	}
+	return n;
+}
+#endif
+
+int
+cp_poll_batch(struct connection_pool *c, struct pool_message *m, int n) {
+#ifdef CONNECTION_THREAD
+	if (c->eventfd >= 0)
+		clear_event(c);
+	crypto_message(c);
+#endif
+	if (submit_message(c) > 0)
+		limit_memory(c);
+	if (c->callback) {
+		dispatch_message(c);
+		return 0;
 	}
+	return poll_message(c, m, n);
 }
 
-int 
+int
 cp_poll(struct connection_pool *c, struct pool_message *m) {
-	if (c->temp) {
-		free(c->temp);
-		c->temp = NULL;
+	if (cp_poll_batch(c, m, 1) == 0)
+		return POOL_EMPTY;
+	return m->type;
+}
+
+int
+cp_submit(struct connection_pool *cp, int id, char * buffer, size_t sz) {
+	if (cp->submit == NULL)
+		return -1;
+	uint64_t mask = cp->submit_cap - 1;
+	uint64_t pos = __atomic_load_n(&cp->enqueue, __ATOMIC_RELAXED);
+	struct submit *s;
+	for (;;) {
+		s = &cp->submit[pos & mask];
+		uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&cp->enqueue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			// full
+			return -1;
+		} else {
+			pos = __atomic_load_n(&cp->enqueue, __ATOMIC_RELAXED);
+		}
+	}
+	s->id = id;
+	s->sz = sz;
+	s->buffer = buffer;
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	signal_event(cp);
+	return 0;
+}
+
+int
+cp_submitfd(struct connection_pool *cp) {
+	return cp->eventfd;
+}
+
+void
+cp_wakeup(struct connection_pool *cp) {
+	if (cp->eventfd >= 0)
+		signal_event(cp);
+}
+
+void 
+cp_recv(struct connection_pool *cp, int fd, const char * buffer, size_t sz) {
+	recv_message(cp, fd, buffer, sz);
+	limit_memory(cp);
+	dispatch_message(cp);
+}
+
+int
+cp_recv_inplace(struct connection_pool *cp, int fd, char * buffer, size_t sz, struct pool_message *m) {
+	int type = recv_inplace(cp, fd, buffer, sz, m);
+	limit_memory(cp);
+	dispatch_message(cp);
+	return type;
+}
+
+int
+cp_match(struct connection_pool *cp, uint64_t request, uint32_t fingerprint) {
+	return connection_match(cp, request, fingerprint) != NULL;
+}
+
+int
+cp_send(struct connection_pool *cp, int id, const char *buffer, size_t sz) {
+	int r = send_message(cp, id, buffer, sz);
+	limit_memory(cp);
+	dispatch_message(cp);
+	return r;
+}
+
+static void
+timer_expire(struct connection_pool *cp, int node) {
+	if (node & 1) {
+		// detached connection, it can't be resumed any more
+		struct connection *c = get_slot(cp, node >> 1);
+		assert(c->fd < 0);
+		free_connection(cp, c);
+	} else {
+		struct handshake *hs = &cp->handshake[node >> 1];
+		handshake_kick(cp, hs);
+	}
+}
+
+static void
+timer_execute(struct connection_pool *cp) {
+	int *bucket = &cp->timer[cp->time & TIME_NEAR_MASK];
+	while (*bucket >= 0) {
+		int node = *bucket;
+		timer_unlink(cp, node);
+		timer_expire(cp, node);
 	}
-	if (c->out_head) {
-		c->temp = c->out_head;
-		c->out_head = c->temp->next;
-		if (c->out_head == NULL) {
-			c->out_tail = NULL;
+}
+
+// move the nodes of level[level][index] to lower levels
+static void
+timer_cascade(struct connection_pool *cp, int level, int index) {
+	int *bucket = &cp->timer[TIME_NEAR + level * TIME_LEVEL + index];
+	int node = *bucket;
+	*bucket = -1;
+	while (node >= 0) {
+		struct timer_node *t = get_timer(cp, node);
+		int next = t->next;
+		t->bucket = -1;
+		timer_place(cp, node);
+		node = next;
+	}
+}
+
+static void
+timer_shift(struct connection_pool *cp) {
+	uint32_t ct = ++cp->time;
+	if (ct == 0) {
+		timer_cascade(cp, 3, 0);
+		return;
+	}
+	uint32_t time = ct >> TIME_NEAR_SHIFT;
+	uint32_t mask = TIME_NEAR;
+	int i = 0;
+	while ((ct & (mask-1)) == 0) {
+		int index = time & TIME_LEVEL_MASK;
+		if (index != 0) {
+			timer_cascade(cp, i, index);
+			break;
 		}
-		fill_message(c,m);
-		if (m->sz == 0) {
-			close_fd(c, m->id);
+		mask <<= TIME_LEVEL_SHIFT;
+		time >>= TIME_LEVEL_SHIFT;
+		++i;
+	}
+}
+
+// move the nodes of bucket to the list
+static void
+timer_collect(struct connection_pool *cp, int bucket, int *list) {
+	int node = cp->timer[bucket];
+	cp->timer[bucket] = -1;
+	while (node >= 0) {
+		struct timer_node *t = get_timer(cp, node);
+		int next = t->next;
+		t->bucket = -1;
+		t->next = *list;
+		*list = node;
+		node = next;
+	}
+}
+
+// advance n >= TIME_NEAR ticks at once. all the near slots expire, and a level keeps the buckets
+// after the digit of the new time if the digits above it don't change. the rest expire, or are
+// placed again when they are in the bucket of the digit
+static void
+timer_jump(struct connection_pool *cp, uint32_t n) {
+	uint32_t time = cp->time;
+	uint32_t target = time + n;
+	int list = -1;
+	int i,j;
+	for (i=0;i<TIME_NEAR;i++) {
+		if (cp->timer[i] >= 0)
+			timer_collect(cp, i, &list);
+	}
+	for (i=0;i<4;i++) {
+		int shift = TIME_NEAR_SHIFT + i * TIME_LEVEL_SHIFT;
+		int digit = (target >> shift) & TIME_LEVEL_MASK;
+		int keep;
+		if (i == 3) {
+			keep = target > time;
+		} else {
+			keep = (target >> (shift + TIME_LEVEL_SHIFT)) == (time >> (shift + TIME_LEVEL_SHIFT));
+		}
+		for (j=0;j<TIME_LEVEL;j++) {
+			int bucket = TIME_NEAR + i * TIME_LEVEL + j;
+			if (cp->timer[bucket] >= 0 && !(keep && j > digit))
+				timer_collect(cp, bucket, &list);
 		}
-		return POOL_OUT;
-	} 
-	if (c->in_head) {
-		c->temp = c->in_head;
-		c->in_head = c->temp->next;
-		if (c->in_head == NULL) {
-			c->in_tail = NULL;
+	}
+	cp->time = target;
+	while (list >= 0) {
+		int node = list;
+		struct timer_node *t = get_timer(cp, node);
+		list = t->next;
+		if (t->expire - time <= n) {
+			timer_expire(cp, node);
+		} else {
+			timer_place(cp, node);
 		}
-		fill_message(c,m);
-		return POOL_IN;
 	}
-	return POOL_EMPTY;
 }
 
+void
+cp_timeout(struct connection_pool *cp, unsigned int tick) {
+	if (!cp->tick_init) {
+		cp->tick_init = 1;
+		cp->tick = tick;
+		return;
+	}
+	uint32_t n = tick - cp->tick;
+	if ((int32_t)n < 0) {
+		// the clock goes back, wait until it catches up
+		n = 0;
+	} else {
+		cp->tick = tick;
+	}
+	if (n >= TIME_NEAR) {
+		timer_jump(cp, n);
+	} else {
+		uint32_t i;
+		for (i=0;i<n;i++) {
+			timer_execute(cp);
+			timer_shift(cp);
+			timer_execute(cp);
+		}
+	}
+	fill_keypair(cp);
+	limit_memory(cp);
+	dispatch_message(cp);
+}
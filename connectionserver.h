@@ -2,26 +2,85 @@
 #define connection_server_h
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct connection_pool;
 
 struct pool_message {
+	int type;
 	int id;
 	size_t sz;
 	const char *buffer;
 };
 
+// 0 means the default value
+struct cp_config {
+	int maxsocket;	// max stable connections, default is unlimited
+	int maxslot;	// slots of the ids, default and limit is 2^24-1. the id of a slot repeats after 128 sessions
+	int fdsize;	// initial size of the fd table, it grows on demand
+	int sendcache;	// replay window of each connection in bytes, or the limit of unacked bytes in ack mode
+	int fingerprint;	// checkpoint granularity, must divide pagesize and match the client
+	int pagesize;	// replay cache is allocated by pages shared by all the connections
+	int maxhandshake;	// handshakes in progress, more fds are closed at once
+	int handshake_timeout;	// ticks of cp_timeout before an unfinished handshake is closed
+	int detached_timeout;	// ticks of cp_timeout before a connection without fd is released
+	size_t memory;	// bytes of connections and replay cache, default is unlimited. see POOL_EVICT
+	// submit and crypto need connectionserver.c built with -DCONNECTION_THREAD, or cp_new_ex returns NULL
+	int submit;	// size of the cp_submit ring, 0 : cp_submit is disabled
+	int crypto;	// threads computing the D-H of new handshakes, 0 : computed in cp_recv. see cp_submitfd
+	int keypairs;	// ephemeral keys of D-H computed in cp_timeout for the next new handshakes
+	uint64_t seed;	// seed of the random generator for reproducible runs, default is from the system entropy
+	int ack;	// ack mode : the client acks its recvcount, see cc_config.ack. the replay cache is freed by acks
+	// callback mode : messages are dispatched inside cp_recv/cp_send instead of cp_poll,
+	// the buffer is valid during the call. NULL callback drops the message
+	void (*on_data)(void *ud, int id, const char *buffer, size_t sz);
+	void (*on_write)(void *ud, int fd, const char *buffer, size_t sz);
+	void (*on_close)(void *ud, int fd);
+	void (*on_evict)(void *ud, int id);
+	void (*on_window)(void *ud, int id);
+	void *ud;
+};
+
 struct connection_pool * cp_new();
+struct connection_pool * cp_new_ex(const struct cp_config *config);
 void cp_delete(struct connection_pool *cp);
-void cp_timeout(struct connection_pool *cp);
+// tick is a monotonic clock of the caller, the first call only sets the origin
+void cp_timeout(struct connection_pool *cp, unsigned int tick);
 
 void cp_recv(struct connection_pool *cp, int fd, const char * buffer, size_t sz);
-void cp_send(struct connection_pool *cp, int id, const char * buffer, size_t sz);
+// returns -1 in ack mode if the unacked bytes would exceed sendcache, or if the replay cache
+// can't grow any more, nothing is sent. otherwise 0
+// in ack mode a message larger than sendcache returns -2, it never fits. the client acks before
+// half of cc_config.window is unacked, so a message up to half of sendcache never waits forever.
+// after -1 for the unacked bytes, cp_poll returns POOL_WINDOW of id (or calls on_window) when the
+// message fits, send it again then. -1 for the replay cache has no event, retry it later
+int cp_send(struct connection_pool *cp, int id, const char * buffer, size_t sz);
 
 #define POOL_EMPTY 0
 #define POOL_IN 1
 #define POOL_OUT 2
+// a connection without fd is released for the memory limit, id is the connection
+#define POOL_EVICT 3
+// ack mode : the acks of id leave room for the message cp_send refused with -1 last time
+#define POOL_WINDOW 4
 
 int cp_poll(struct connection_pool *cp, struct pool_message *m);
+// fill at most n messages, returns the number of messages
+int cp_poll_batch(struct connection_pool *cp, struct pool_message *m, int n);
+// same as cp_recv, but decrypt in buffer. returns POOL_IN with the plain text in m, or POOL_EMPTY
+int cp_recv_inplace(struct connection_pool *cp, int fd, char * buffer, size_t sz, struct pool_message *m);
+// any thread can call it. buffer is allocated by malloc and freed by the pool after it's sent in cp_poll,
+// sz 0 closes id. returns -1 if the ring is full, then the buffer is still owned by the caller.
+// when cp_send would return -1, the message stays in the ring and the later ones wait behind it
+// until an ack, so the ring may fill up. a message cp_send rejects with -2 is dropped
+int cp_submit(struct connection_pool *cp, int id, char * buffer, size_t sz);
+// an fd readable after cp_submit or a D-H done by the crypto threads, call cp_poll then.
+// an eventfd on linux, the read end of a pipe on the other unix. -1 without submit and crypto.
+// in callback mode cp_poll only dispatches the messages
+int cp_submitfd(struct connection_pool *cp);
+// any thread can call it, cp_submitfd becomes readable until the next cp_poll
+void cp_wakeup(struct connection_pool *cp);
+// returns 1 if the reuse handshake (request, fingerprint) can resume a connection of cp
+int cp_match(struct connection_pool *cp, uint64_t request, uint32_t fingerprint);
 
 #endif
@@ -0,0 +1,590 @@
+#define _GNU_SOURCE
+#include "connectionshard.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <poll.h>
+
+#define MAXFD 65536
+// must match connectionserver.c
+#define HANDSHAKETIMEOUT 1000
+// must match connectionserver.c, id = version << ID_SLOTBITS | (slot + 1)
+#define ID_SLOTBITS 24
+#define ID_SLOTMASK ((1 << ID_SLOTBITS) - 1)
+
+#define SHARD_RECV 0
+#define SHARD_SEND 1
+#define SHARD_TIMEOUT 2
+
+struct request {
+	struct request *next;
+	int type;
+	int id;	// fd of SHARD_RECV, id of SHARD_SEND
+	size_t sz;	// tick of SHARD_TIMEOUT
+	// followed by sz bytes of data
+};
+
+struct shard {
+	struct shard_pool *sp;
+	int index;
+	pthread_t thread;
+	// requests from other threads
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_cond_t idle;
+	struct request *head;
+	struct request *tail;
+	int busy;
+	int quit;
+	// the pool is locked by the owner thread during a batch, and by cs_recv to match a resumed connection
+	pthread_mutex_t pool_lock;
+	struct connection_pool *pool;
+};
+
+// the shard of fd, -1 until the first bytes of handshake are seen. the shard thread only sets
+// shard back to -1 when it closes fd, the rest is owned by cs_recv and cs_timeout under partial_lock
+struct route {
+	int shard;
+	int sz;
+	// list of the partial headers, from the oldest one
+	int prev;
+	int next;
+	unsigned int tick;
+	uint8_t header[12];
+};
+
+struct shard_pool {
+	int n;
+	int maxfd;
+	struct route *route;
+	struct shard *shard;
+	// a partial header is handed to the shard of fd after timeout, and closed by its pool
+	pthread_mutex_t partial_lock;
+	int partial_head;
+	int partial_tail;
+	int tick_init;
+	unsigned int tick;
+	int timeout;
+	void (*on_data)(void *ud, int id, const char *buffer, size_t sz);
+	void (*on_write)(void *ud, int fd, const char *buffer, size_t sz);
+	void (*on_close)(void *ud, int fd);
+	void (*on_evict)(void *ud, int id);
+	void (*on_window)(void *ud, int id);
+	void *ud;
+};
+
+// the shard running in this thread, cs_send calls cp_send directly in its callbacks
+static __thread struct shard *current = NULL;
+
+// shard is in the low bits of the slot, so the version bits of id keep working
+static int
+global_id(struct shard_pool *sp, int shard, int id) {
+	int slot = (id & ID_SLOTMASK) - 1;
+	return (id & ~ID_SLOTMASK) | (slot * sp->n + shard + 1);
+}
+
+// return the local id, or 0 if gid is invalid
+static int
+local_id(struct shard_pool *sp, int gid, int *shard) {
+	int slot = (gid & ID_SLOTMASK) - 1;
+	if (gid <= 0 || slot < 0)
+		return 0;
+	*shard = slot % sp->n;
+	return (gid & ~ID_SLOTMASK) | (slot / sp->n + 1);
+}
+
+static void
+shard_data(void *ud, int id, const char *buffer, size_t sz) {
+	struct shard *s = ud;
+	struct shard_pool *sp = s->sp;
+	if (sp->on_data)
+		sp->on_data(sp->ud, global_id(sp, s->index, id), buffer, sz);
+}
+
+static void
+shard_write(void *ud, int fd, const char *buffer, size_t sz) {
+	struct shard *s = ud;
+	struct shard_pool *sp = s->sp;
+	if (sp->on_write)
+		sp->on_write(sp->ud, fd, buffer, sz);
+}
+
+static void
+shard_close(void *ud, int fd) {
+	struct shard *s = ud;
+	struct shard_pool *sp = s->sp;
+	// the fd may be reused by a new connection, sz is 0 since it's routed
+	__atomic_store_n(&sp->route[fd].shard, -1, __ATOMIC_RELEASE);
+	if (sp->on_close)
+		sp->on_close(sp->ud, fd);
+}
+
+static void
+shard_evict(void *ud, int id) {
+	struct shard *s = ud;
+	struct shard_pool *sp = s->sp;
+	if (sp->on_evict)
+		sp->on_evict(sp->ud, global_id(sp, s->index, id));
+}
+
+static void
+shard_window(void *ud, int id) {
+	struct shard *s = ud;
+	struct shard_pool *sp = s->sp;
+	if (sp->on_window)
+		sp->on_window(sp->ud, global_id(sp, s->index, id));
+}
+
+// with crypto threads the shard sleeps on the event fd of its pool, a request signals it too
+static void
+wakeup_shard(struct shard *s) {
+	if (cp_submitfd(s->pool) >= 0) {
+		cp_wakeup(s->pool);
+	} else {
+		pthread_cond_signal(&s->wakeup);
+	}
+}
+
+static void
+push_request(struct shard *s, int type, int id, const char *buffer, size_t sz) {
+	size_t bytes = type == SHARD_TIMEOUT ? 0 : sz;
+	struct request *req = malloc(sizeof(*req) + bytes);
+	req->next = NULL;
+	req->type = type;
+	req->id = id;
+	req->sz = sz;
+	if (bytes > 0)
+		memcpy(req+1, buffer, bytes);
+	pthread_mutex_lock(&s->lock);
+	if (s->tail) {
+		s->tail->next = req;
+	} else {
+		s->head = req;
+		wakeup_shard(s);
+	}
+	s->tail = req;
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void
+do_request(struct shard *s, struct request *req) {
+	const char *buffer = req->sz > 0 ? (const char *)(req+1) : NULL;
+	switch (req->type) {
+	case SHARD_RECV:
+		cp_recv(s->pool, req->id, buffer, req->sz);
+		break;
+	case SHARD_SEND:
+		cp_send(s->pool, req->id, buffer, req->sz);
+		break;
+	case SHARD_TIMEOUT:
+		cp_timeout(s->pool, (unsigned int)req->sz);
+		break;
+	}
+}
+
+// reply the handshakes done by the crypto threads
+static void
+poll_shard(struct shard *s) {
+	pthread_mutex_unlock(&s->lock);
+	struct pollfd pfd = { cp_submitfd(s->pool), POLLIN, 0 };
+	poll(&pfd, 1, -1);
+	pthread_mutex_lock(&s->lock);
+	s->busy = 1;
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&s->pool_lock);
+	struct pool_message pm;
+	// callback mode, the messages are dispatched
+	cp_poll(s->pool, &pm);
+	pthread_mutex_unlock(&s->pool_lock);
+
+	pthread_mutex_lock(&s->lock);
+	s->busy = 0;
+	if (s->head == NULL)
+		pthread_cond_broadcast(&s->idle);
+}
+
+static void *
+shard_thread(void *ud) {
+	struct shard *s = ud;
+	current = s;
+	int event = cp_submitfd(s->pool) >= 0;
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		s->busy = 0;
+		if (s->head == NULL)
+			pthread_cond_broadcast(&s->idle);
+		while (s->head == NULL && !s->quit) {
+			if (event)
+				poll_shard(s);
+			else
+				pthread_cond_wait(&s->wakeup, &s->lock);
+		}
+		struct request *req = s->head;
+		s->head = s->tail = NULL;
+		s->busy = 1;
+		int quit = s->quit;
+		pthread_mutex_unlock(&s->lock);
+
+		pthread_mutex_lock(&s->pool_lock);
+		while (req) {
+			struct request *next = req->next;
+			do_request(s, req);
+			free(req);
+			req = next;
+		}
+		pthread_mutex_unlock(&s->pool_lock);
+		if (quit)
+			break;
+	}
+	return NULL;
+}
+
+static void
+pin_thread(struct shard *s) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(s->index % cpus, &set);
+	pthread_setaffinity_np(s->thread, sizeof(set), &set);
+}
+
+struct shard_pool *
+cs_new(const struct cs_config *config) {
+	struct cs_config cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	if (config)
+		cfg = *config;
+	if (cfg.shards <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cfg.shards = cpus > 0 ? (int)cpus : 1;
+	}
+	if (cfg.maxfd <= 0)
+		cfg.maxfd = MAXFD;
+	// slots of the shards share the slot bits of id
+	int limit = ID_SLOTMASK / cfg.shards;
+	if (cfg.pool.maxslot == 0) {
+		cfg.pool.maxslot = limit;
+	} else {
+		cfg.pool.maxslot = (cfg.pool.maxslot + cfg.shards - 1) / cfg.shards;
+		if (cfg.pool.maxslot > limit)
+			return NULL;
+	}
+	if (cfg.pool.maxsocket > 0)
+		cfg.pool.maxsocket = (cfg.pool.maxsocket + cfg.shards - 1) / cfg.shards;
+	if (cfg.pool.memory > 0)
+		cfg.pool.memory = (cfg.pool.memory + cfg.shards - 1) / cfg.shards;
+	if (cfg.pool.handshake_timeout <= 0)
+		cfg.pool.handshake_timeout = HANDSHAKETIMEOUT;
+	// the pools are not exposed, cs_send is the submit of other threads
+	cfg.pool.submit = 0;
+	struct shard_pool *sp = malloc(sizeof(*sp));
+	sp->n = cfg.shards;
+	sp->maxfd = cfg.maxfd;
+	sp->route = malloc(cfg.maxfd * sizeof(struct route));
+	int i;
+	for (i=0;i<cfg.maxfd;i++) {
+		sp->route[i].shard = -1;
+		sp->route[i].sz = 0;
+		sp->route[i].prev = -1;
+		sp->route[i].next = -1;
+	}
+	pthread_mutex_init(&sp->partial_lock, NULL);
+	sp->partial_head = -1;
+	sp->partial_tail = -1;
+	sp->tick_init = 0;
+	sp->tick = 0;
+	sp->timeout = cfg.pool.handshake_timeout;
+	sp->on_data = cfg.pool.on_data;
+	sp->on_write = cfg.pool.on_write;
+	sp->on_close = cfg.pool.on_close;
+	sp->on_evict = cfg.pool.on_evict;
+	sp->on_window = cfg.pool.on_window;
+	sp->ud = cfg.pool.ud;
+	cfg.pool.on_data = shard_data;
+	cfg.pool.on_write = shard_write;
+	cfg.pool.on_close = shard_close;
+	cfg.pool.on_evict = shard_evict;
+	cfg.pool.on_window = shard_window;
+	sp->shard = malloc(sp->n * sizeof(struct shard));
+	for (i=0;i<sp->n;i++) {
+		struct shard *s = &sp->shard[i];
+		s->sp = sp;
+		s->index = i;
+		cfg.pool.ud = s;
+		s->pool = cp_new_ex(&cfg.pool);
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->wakeup, NULL);
+		pthread_cond_init(&s->idle, NULL);
+		pthread_mutex_init(&s->pool_lock, NULL);
+		s->head = s->tail = NULL;
+		s->busy = 0;
+		s->quit = 0;
+	}
+	for (i=0;i<sp->n;i++) {
+		if (sp->shard[i].pool == NULL) {
+			// invalid config of pool
+			for (i=0;i<sp->n;i++) {
+				struct shard *s = &sp->shard[i];
+				cp_delete(s->pool);
+				pthread_mutex_destroy(&s->lock);
+				pthread_cond_destroy(&s->wakeup);
+				pthread_cond_destroy(&s->idle);
+				pthread_mutex_destroy(&s->pool_lock);
+			}
+			free(sp->shard);
+			free(sp->route);
+			pthread_mutex_destroy(&sp->partial_lock);
+			free(sp);
+			return NULL;
+		}
+	}
+	for (i=0;i<sp->n;i++) {
+		struct shard *s = &sp->shard[i];
+		pthread_create(&s->thread, NULL, shard_thread, s);
+		if (cfg.pin)
+			pin_thread(s);
+	}
+	return sp;
+}
+
+void
+cs_delete(struct shard_pool *sp) {
+	int i;
+	for (i=0;i<sp->n;i++) {
+		struct shard *s = &sp->shard[i];
+		pthread_mutex_lock(&s->lock);
+		s->quit = 1;
+		wakeup_shard(s);
+		pthread_mutex_unlock(&s->lock);
+	}
+	for (i=0;i<sp->n;i++) {
+		struct shard *s = &sp->shard[i];
+		pthread_join(s->thread, NULL);
+		struct request *req = s->head;
+		while (req) {
+			struct request *next = req->next;
+			free(req);
+			req = next;
+		}
+		cp_delete(s->pool);
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->wakeup);
+		pthread_cond_destroy(&s->idle);
+		pthread_mutex_destroy(&s->pool_lock);
+	}
+	free(sp->shard);
+	free(sp->route);
+	pthread_mutex_destroy(&sp->partial_lock);
+	free(sp);
+}
+
+static uint64_t
+leuint64(const uint8_t * t) {
+	uint32_t x = t[0] | t[1] << 8 | t[2] << 16 | t[3] << 24;
+	uint32_t y = t[4] | t[5] << 8 | t[6] << 16 | t[7] << 24;
+	return (uint64_t)x | (uint64_t)y << 32;
+}
+
+static uint32_t
+leuint32(const uint8_t * t) {
+	return t[0] | t[1] << 8 | t[2] << 16 | t[3] << 24;
+}
+
+// a new connection goes to the shard of fd, a resumed one to the shard holding it.
+// return -1 if more bytes are needed
+static int
+route_shard(struct shard_pool *sp, int fd, const uint8_t *header) {
+	uint64_t request = leuint64(header);
+	if (request != 0) {
+		uint32_t fingerprint = leuint32(header + 8);
+		int i;
+		for (i=0;i<sp->n;i++) {
+			struct shard *s = &sp->shard[i];
+			pthread_mutex_lock(&s->pool_lock);
+			int found = cp_match(s->pool, request, fingerprint);
+			pthread_mutex_unlock(&s->pool_lock);
+			if (found)
+				return i;
+		}
+	}
+	// not found : the shard of fd replies a reset
+	return fd % sp->n;
+}
+
+static void
+partial_link(struct shard_pool *sp, int fd) {
+	struct route *r = &sp->route[fd];
+	r->tick = sp->tick;
+	r->prev = sp->partial_tail;
+	r->next = -1;
+	if (sp->partial_tail >= 0) {
+		sp->route[sp->partial_tail].next = fd;
+	} else {
+		sp->partial_head = fd;
+	}
+	sp->partial_tail = fd;
+}
+
+static void
+partial_unlink(struct shard_pool *sp, int fd) {
+	struct route *r = &sp->route[fd];
+	if (r->prev >= 0) {
+		sp->route[r->prev].next = r->next;
+	} else {
+		sp->partial_head = r->next;
+	}
+	if (r->next >= 0) {
+		sp->route[r->next].prev = r->prev;
+	} else {
+		sp->partial_tail = r->prev;
+	}
+	r->prev = r->next = -1;
+}
+
+static void
+push_routed(struct shard_pool *sp, int shard, int fd, const char * buffer, size_t sz) {
+	if (sz == 0)
+		__atomic_store_n(&sp->route[fd].shard, -1, __ATOMIC_RELEASE);
+	push_request(&sp->shard[shard], SHARD_RECV, fd, buffer, sz);
+}
+
+int
+cs_recv(struct shard_pool *sp, int fd, const char * buffer, size_t sz) {
+	if (fd < 0 || fd >= sp->maxfd)
+		return -1;
+	struct route *r = &sp->route[fd];
+	int shard = __atomic_load_n(&r->shard, __ATOMIC_ACQUIRE);
+	if (shard >= 0) {
+		push_routed(sp, shard, fd, buffer, sz);
+		return 0;
+	}
+	pthread_mutex_lock(&sp->partial_lock);
+	shard = __atomic_load_n(&r->shard, __ATOMIC_ACQUIRE);
+	if (shard >= 0) {
+		// the partial header is handed to a shard by cs_timeout
+		pthread_mutex_unlock(&sp->partial_lock);
+		push_routed(sp, shard, fd, buffer, sz);
+		return 0;
+	}
+	// a partial header is in the list
+	int linked = r->sz > 0;
+	if (sz == 0) {
+		// closed before the shard is known
+		if (linked)
+			partial_unlink(sp, fd);
+		r->sz = 0;
+		pthread_mutex_unlock(&sp->partial_lock);
+		return 0;
+	}
+	// 8 bytes request, and 4 bytes fingerprint if request is not 0
+	size_t need = r->sz < 8 ? 8 - r->sz : 12 - r->sz;
+	if (need > sz)
+		need = sz;
+	memcpy(r->header + r->sz, buffer, need);
+	r->sz += need;
+	buffer += need;
+	sz -= need;
+	if (r->sz == 8 && leuint64(r->header) != 0 && sz > 0) {
+		need = sz < 4 ? sz : 4;
+		memcpy(r->header + r->sz, buffer, need);
+		r->sz += need;
+		buffer += need;
+		sz -= need;
+	}
+	if (r->sz < 8 || (r->sz < 12 && leuint64(r->header) != 0)) {
+		if (!linked)
+			partial_link(sp, fd);
+		pthread_mutex_unlock(&sp->partial_lock);
+		return 0;
+	}
+	if (linked)
+		partial_unlink(sp, fd);
+	uint8_t header[12];
+	int hsz = r->sz;
+	memcpy(header, r->header, hsz);
+	r->sz = 0;
+	pthread_mutex_unlock(&sp->partial_lock);
+
+	// not in the list, cs_timeout doesn't touch it
+	shard = route_shard(sp, fd, header);
+	struct shard *s = &sp->shard[shard];
+	push_request(s, SHARD_RECV, fd, (const char *)header, hsz);
+	if (sz > 0)
+		push_request(s, SHARD_RECV, fd, buffer, sz);
+	__atomic_store_n(&r->shard, shard, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int
+cs_send(struct shard_pool *sp, int id, const char * buffer, size_t sz) {
+	int shard;
+	id = local_id(sp, id, &shard);
+	if (id == 0)
+		return 0;
+	struct shard *s = &sp->shard[shard];
+	if (current == s)
+		return cp_send(s->pool, id, buffer, sz);
+	push_request(s, SHARD_SEND, id, buffer, sz);
+	return 0;
+}
+
+// hand the expired partial headers to the shard of fd, its pool closes them after handshake_timeout
+static void
+partial_timeout(struct shard_pool *sp, unsigned int tick) {
+	pthread_mutex_lock(&sp->partial_lock);
+	int fd;
+	if (!sp->tick_init) {
+		// the first call only sets the origin
+		sp->tick_init = 1;
+		for (fd = sp->partial_head; fd >= 0; fd = sp->route[fd].next) {
+			sp->route[fd].tick = tick;
+		}
+	}
+	sp->tick = tick;
+	while ((fd = sp->partial_head) >= 0) {
+		struct route *r = &sp->route[fd];
+		if ((int)(tick - r->tick) < sp->timeout)
+			break;
+		partial_unlink(sp, fd);
+		int shard = fd % sp->n;
+		push_request(&sp->shard[shard], SHARD_RECV, fd, (const char *)r->header, r->sz);
+		r->sz = 0;
+		__atomic_store_n(&r->shard, shard, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&sp->partial_lock);
+}
+
+void
+cs_timeout(struct shard_pool *sp, unsigned int tick) {
+	partial_timeout(sp, tick);
+	int i;
+	for (i=0;i<sp->n;i++) {
+		push_request(&sp->shard[i], SHARD_TIMEOUT, 0, NULL, tick);
+	}
+}
+
+void
+cs_wait(struct shard_pool *sp) {
+	// a shard may queue requests to another one, so wait until all of them are idle at once
+	int i, again;
+	do {
+		again = 0;
+		for (i=0;i<sp->n;i++) {
+			struct shard *s = &sp->shard[i];
+			pthread_mutex_lock(&s->lock);
+			if (s->head || s->busy) {
+				again = 1;
+				while (s->head || s->busy)
+					pthread_cond_wait(&s->idle, &s->lock);
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+	} while (again);
+}
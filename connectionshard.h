@@ -0,0 +1,35 @@
+#ifndef connection_shard_h
+#define connection_shard_h
+
+#include "connectionserver.h"
+
+// N connection pools, each one is owned by a thread. all the messages are dispatched by
+// the callbacks of cs_config.pool, called from the thread of the shard the fd or id belongs to.
+struct shard_pool;
+
+// 0 means the default value
+struct cs_config {
+	int shards;	// number of pools and threads, default is the number of cpus
+	int maxfd;	// fds passed to cs_recv are less than maxfd
+	int pin;	// pin the thread of shard i to cpu i
+	struct cp_config pool;	// config of each pool, maxsocket, maxslot and memory are the total. callbacks are required.
+	// submit is ignored, use cs_send. with crypto threads, the handshakes are replied by the shard threads
+};
+
+struct shard_pool * cs_new(const struct cs_config *config);
+void cs_delete(struct shard_pool *sp);
+
+// fd is routed to a shard by the first bytes of handshake, a resumed connection goes back to its shard.
+// calls of the same fd must not be concurrent, returns -1 if fd >= maxfd
+int cs_recv(struct shard_pool *sp, int fd, const char * buffer, size_t sz);
+// id has the shard in it. any thread can call it, the buffer is copied unless it's called
+// in a callback of the same shard, and then returns the result of cp_send. otherwise 0,
+// and a copy cp_send refuses is dropped. in ack mode on_window tells when id can send again
+int cs_send(struct shard_pool *sp, int id, const char * buffer, size_t sz);
+// an fd with a partial header (less than 8 or 12 bytes) for handshake_timeout ticks is handed to
+// the shard of fd, and closed by its pool after another handshake_timeout
+void cs_timeout(struct shard_pool *sp, unsigned int tick);
+// wait until all the requests queued before are done
+void cs_wait(struct shard_pool *sp);
+
+#endif
@@ -2,11 +2,45 @@
 
 // The biggest 64bit prime
 #define P 0xffffffffffffffc5ull
+// The generator of D-H
+#define G 5
 
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sys/random.h>
+#define RANDOM_GETRANDOM
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+// arc4random_buf is in stdlib.h
+#define RANDOM_ARC4
+#endif
+
+#ifdef __SIZEOF_INT128__
+
+// P = 2^64 - 59, so 2^64 = 59 (mod P)
+static inline uint64_t
+mul_mod_p(uint64_t a, uint64_t b) {
+	unsigned __int128 x = (unsigned __int128)a * b;
+	// x = hi * 2^64 + lo = hi * 59 + lo, < 2^70
+	x = (unsigned __int128)(uint64_t)(x >> 64) * 59 + (uint64_t)x;
+	uint64_t hi = (uint64_t)(x >> 64);
+	uint64_t lo = (uint64_t)x;
+	uint64_t m = lo + hi * 59;
+	if (m < lo) {
+		// overflow, m is less than 64 * 59 now
+		m += 59;
+	}
+	if (m >= P)
+		m -= P;
+	return m;
+}
+
+#else
 
 static inline uint64_t
 mul_mod_p(uint64_t a, uint64_t b) {
@@ -30,34 +64,182 @@ mul_mod_p(uint64_t a, uint64_t b) {
 	return m;
 }
 
+#endif
+
 static inline uint64_t
 pow_mod_p(uint64_t a, uint64_t b) {
-	if (b==1) {
-		return a;
+	uint64_t m = 1;
+	while (b) {
+		if (b & 1)
+			m = mul_mod_p(m, a);
+		a = mul_mod_p(a, a);
+		b >>= 1;
 	}
-	uint64_t t = pow_mod_p(a, b>>1);
-	t = mul_mod_p(t,t);
-	if (b % 2) {
-		t = mul_mod_p(t, a);
-	}
-	return t;
+	return m;
 }
 
 // calc a^b % p
 uint64_t
 powmodp(uint64_t a, uint64_t b) {
-	if (a > P)
-		a%=P;
+	if (a >= P)
+		a -= P;
 	return pow_mod_p(a,b);
 }
 
+// fixed base table : gtable[i][d] = G ^ (d << (GWINDOW * i)), so G ^ b is 8 multiplies
+#define GWINDOW 8
+static uint64_t gtable[64 / GWINDOW][1 << GWINDOW];
+
+// built at load time, so it's read only when any thread uses it
+__attribute__((constructor))
+static void
+gtable_init() {
+	uint64_t base = G;
+	int i,j;
+	for (i=0;i<64 / GWINDOW;i++) {
+		gtable[i][0] = 1;
+		for (j=1;j<1 << GWINDOW;j++) {
+			gtable[i][j] = mul_mod_p(gtable[i][j-1], base);
+		}
+		base = mul_mod_p(gtable[i][(1 << GWINDOW) - 1], base);
+	}
+}
+
+// calc G^b % p
 uint64_t
-randomint64() {
-	uint64_t a = rand();
-	uint64_t b = rand() & 0xffff;
-	uint64_t c = rand() & 0xffff;
-	uint64_t d = (rand() & 0xffff) + 1;	// avoid result 0
-	return a << 48 | b << 32 | c << 16 | d;
+powmodg(uint64_t b) {
+	uint64_t m = gtable[0][b & ((1 << GWINDOW) - 1)];
+	int i;
+	for (i=1;i<64 / GWINDOW;i++) {
+		b >>= GWINDOW;
+		m = mul_mod_p(m, gtable[i][b & ((1 << GWINDOW) - 1)]);
+	}
+	return m;
+}
+
+#define ROTL32(x, n) ((x) << (n) | (x) >> (32 - (n)))
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+static void
+chacha20_block(const uint32_t in[16], uint32_t out[16]) {
+	int i;
+	for (i=0;i<16;i++) {
+		out[i] = in[i];
+	}
+	for (i=0;i<10;i++) {
+		QUARTERROUND(out[0], out[4], out[8], out[12])
+		QUARTERROUND(out[1], out[5], out[9], out[13])
+		QUARTERROUND(out[2], out[6], out[10], out[14])
+		QUARTERROUND(out[3], out[7], out[11], out[15])
+		QUARTERROUND(out[0], out[5], out[10], out[15])
+		QUARTERROUND(out[1], out[6], out[11], out[12])
+		QUARTERROUND(out[2], out[7], out[8], out[13])
+		QUARTERROUND(out[3], out[4], out[9], out[14])
+	}
+	for (i=0;i<16;i++) {
+		out[i] += in[i];
+	}
+}
+
+// state : 4 words "expand 32-byte k", 8 words key, 2 words block counter, 2 words nonce (0)
+static void
+random_key(struct random_state *rs, const uint32_t key[8]) {
+	rs->state[0] = 0x61707865;
+	rs->state[1] = 0x3320646e;
+	rs->state[2] = 0x79622d32;
+	rs->state[3] = 0x6b206574;
+	memcpy(rs->state + 4, key, 8 * sizeof(uint32_t));
+	memset(rs->state + 12, 0, 4 * sizeof(uint32_t));
+	rs->pos = 16;
+}
+
+// for the kernels without getrandom, a seccomp filter denying it, or the other unix
+static int
+random_urandom(uint8_t *buffer, size_t sz) {
+	FILE *f = fopen("/dev/urandom", "rb");
+	if (f == NULL)
+		return 0;
+	size_t n = fread(buffer, 1, sz, f);
+	fclose(f);
+	return n == sz;
+}
+
+static void
+random_entropy(uint8_t *buffer, size_t sz) {
+	int err = 0;
+#if defined(RANDOM_GETRANDOM)
+	size_t n = 0;
+	while (n < sz) {
+		ssize_t r = getrandom(buffer + n, sz - n, 0);
+		if (r < 0) {
+			err = errno;
+			if (err == EINTR)
+				continue;
+			break;
+		}
+		n += r;
+	}
+	if (n == sz)
+		return;
+#elif defined(RANDOM_ARC4)
+	arc4random_buf(buffer, sz);
+	return;
+#endif
+	if (!random_urandom(buffer, sz)) {
+		fprintf(stderr, "random_init : no source of entropy (errno %d)\n", err);
+		abort();
+	}
+}
+
+void
+random_init(struct random_state *rs, uint64_t seed) {
+	uint32_t key[8];
+	if (seed == 0) {
+		uint8_t buffer[32];
+		random_entropy(buffer, sizeof(buffer));
+		int i;
+		for (i=0;i<8;i++) {
+			key[i] = buffer[i*4] | buffer[i*4+1] << 8 | buffer[i*4+2] << 16 | (uint32_t)buffer[i*4+3] << 24;
+		}
+	} else {
+		memset(key, 0, sizeof(key));
+		key[0] = (uint32_t)seed;
+		key[1] = (uint32_t)(seed >> 32);
+	}
+	random_key(rs, key);
+}
+
+void
+random_fork(struct random_state *rs, struct random_state *child) {
+	uint32_t key[8];
+	int i;
+	for (i=0;i<8;i+=2) {
+		uint64_t r = random_next(rs);
+		key[i] = (uint32_t)r;
+		key[i+1] = (uint32_t)(r >> 32);
+	}
+	random_key(child, key);
+}
+
+uint64_t
+random_next(struct random_state *rs) {
+	for (;;) {
+		if (rs->pos >= 16) {
+			chacha20_block(rs->state, rs->block);
+			if (++rs->state[12] == 0)
+				++rs->state[13];
+			rs->pos = 0;
+		}
+		uint64_t r = (uint64_t)rs->block[rs->pos] | (uint64_t)rs->block[rs->pos+1] << 32;
+		rs->pos += 2;
+		// avoid result 0
+		if (r != 0)
+			return r;
+	}
 }
 
 // Constants are the integer part of the sines of integers (in radians) * 2^32.
@@ -167,3 +349,22 @@ rc4_encode(struct rc4_sbox *rs, const uint8_t *src, uint8_t *des, size_t sz) {
 	}
 	return rs->fingerprint;
 }
+
+// same as rc4_encode, but the fingerprint follows src (the cipher text)
+uint32_t
+rc4_decode(struct rc4_sbox *rs, const uint8_t *src, uint8_t *des, size_t sz) {
+	size_t i;
+	for (i=0;i<sz;i++) {
+		rs->i = (rs->i + 1) % 256;
+		rs->j = (rs->j + rs->sbox[rs->i]) % 256;
+		uint8_t si = rs->sbox[rs->i];
+		uint8_t sj = rs->sbox[rs->j];
+		rs->sbox[rs->i] = sj;
+		rs->sbox[rs->j] = si;
+		uint8_t s = src[i];
+		des[i] = s ^ rs->sbox[(si+sj) % 256];
+		
+		rs->fingerprint = LEFTROTATE(rs->fingerprint , 4) ^ s;
+	}
+	return rs->fingerprint;
+}
@@ -5,7 +5,21 @@
 #include <stddef.h>
 
 uint64_t powmodp(uint64_t a, uint64_t b);
-uint64_t randomint64();
+// powmodp(G, b) of the D-H generator G = 5
+uint64_t powmodg(uint64_t b);
+// ChaCha20 as a random generator, 8 results per block
+struct random_state {
+	uint32_t state[16];
+	uint32_t block[16];
+	int pos;
+};
+
+// seed 0 : the key is from getrandom() on linux, arc4random_buf() on apple and bsd, or /dev/urandom
+void random_init(struct random_state *rs, uint64_t seed);
+// init child with a key from rs, for another thread
+void random_fork(struct random_state *rs, struct random_state *child);
+// never returns 0
+uint64_t random_next(struct random_state *rs);
 uint64_t hmac(uint64_t x, uint64_t y);
 
 struct rc4_sbox {
@@ -17,6 +31,7 @@ struct rc4_sbox {
 
 uint32_t rc4_init(struct rc4_sbox *rs, uint64_t seed);
 uint32_t rc4_encode(struct rc4_sbox *rs, const uint8_t *src, uint8_t *des, size_t sz);
+uint32_t rc4_decode(struct rc4_sbox *rs, const uint8_t *src, uint8_t *des, size_t sz);
 
 #endif
 
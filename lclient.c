@@ -48,6 +48,10 @@ lpoll(lua_State *L) {
 		return 0;
 	}
 	lua_pushinteger(L, t);
+	if (t == MESSAGE_RESET) {
+		// no message : close the socket, and handshake on a new one
+		return 1;
+	}
 	lua_pushlstring(L, msg.buffer, msg.sz);
 	return 2;
 }
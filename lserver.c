@@ -30,8 +30,9 @@ lsend(lua_State *L) {
 	if (sz == 0) {
 		buffer = NULL;
 	}
-	cp_send(c, id, buffer, sz);
-	return 0;
+	// false : refused, send it again after poll returns 4 (POOL_WINDOW) for id
+	lua_pushboolean(L, cp_send(c, id, buffer, sz) == 0);
+	return 1;
 }
 
 static int
@@ -47,6 +48,14 @@ lrecv(lua_State *L) {
 	return 0;
 }
 
+static int
+ltimeout(lua_State *L) {
+	struct connection_pool *c = get_self(L);
+	unsigned int tick = (unsigned int)luaL_checkinteger(L, 2);
+	cp_timeout(c, tick);
+	return 0;
+}
+
 static int
 lpoll(lua_State *L) {
 	struct connection_pool *c = get_self(L);
@@ -57,10 +66,40 @@ lpoll(lua_State *L) {
 	}
 	lua_pushinteger(L, t);
 	lua_pushinteger(L, msg.id);
+	if (t == POOL_EVICT || t == POOL_WINDOW) {
+		// id is released, or id can send again. there is no fd to send
+		return 2;
+	}
 	lua_pushlstring(L, msg.buffer, msg.sz);
 	return 3;
 }
 
+#define POLLBATCH 64
+
+// poll_batch(t) : t[i*3-2], t[i*3-1], t[i*3] = type, id, message ; returns the number of messages
+static int
+lpollbatch(lua_State *L) {
+	struct connection_pool *c = get_self(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	struct pool_message msg[POLLBATCH];
+	int n = 0;
+	int count, i;
+	do {
+		count = cp_poll_batch(c, msg, POLLBATCH);
+		for (i=0;i<count;i++) {
+			lua_pushinteger(L, msg[i].type);
+			lua_rawseti(L, 2, n*3+1);
+			lua_pushinteger(L, msg[i].id);
+			lua_rawseti(L, 2, n*3+2);
+			lua_pushlstring(L, msg[i].buffer, msg[i].sz);
+			lua_rawseti(L, 2, n*3+3);
+			++n;
+		}
+	} while (count == POLLBATCH);
+	lua_pushinteger(L, n);
+	return 1;
+}
+
 static int
 lserver(lua_State *L) {
 	struct connection_pool ** c = lua_newuserdata(L, sizeof(struct connection_pool *));
@@ -69,6 +108,8 @@ lserver(lua_State *L) {
 			{ "send", lsend },
 			{ "recv", lrecv },
 			{ "poll", lpoll },
+			{ "poll_batch", lpollbatch },
+			{ "timeout", ltimeout },
 			{ NULL, NULL },
 		};
 		luaL_newlib(L,l);
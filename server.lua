@@ -62,6 +62,15 @@ local function poll()
 			-- message in
 			current_id = id
 			print("<=======", id, msg)
+		elseif t == 3 then
+			-- evict : id is released
+			print("evict", id)
+			if current_id == id then
+				current_id = nil
+			end
+		elseif t == 4 then
+			-- window : id can send again in ack mode
+			print("window", id)
 		else
 			-- message out
 			local so = assert(fds[id])
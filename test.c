@@ -1,9 +1,34 @@
 #include "connectionserver.h"
 #include "connectionclient.h"
+#include "connectionshard.h"
+#include "encrypt.h"
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <poll.h>
+
+// link with -Wl,--wrap=malloc,--wrap=realloc
+static int malloc_count = 0;
+
+void * __real_malloc(size_t sz);
+void * __real_realloc(void *ptr, size_t sz);
+
+void *
+__wrap_malloc(size_t sz) {
+	__atomic_fetch_add(&malloc_count, 1, __ATOMIC_RELAXED);
+	return __real_malloc(sz);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t sz) {
+	__atomic_fetch_add(&malloc_count, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, sz);
+}
 
 static void
 dump(const char * str, size_t sz, const char * buffer) {
@@ -100,11 +125,1106 @@ test(struct connection_pool * server) {
 	cc_close(client);
 }
 
+// echo messages without dump by batch, return the number of messages polled
+static int
+echo(struct connection_pool * server, struct connection * client) {
+	int n = 0;
+	int last;
+	do {
+		last = n;
+		struct connection_message cm[16];
+		int i, count;
+		while ((count = cc_poll_batch(client, cm, 16)) > 0) {
+			for (i=0;i<count;i++) {
+				if (cm[i].type == MESSAGE_OUT)
+					cp_recv(server, 1, cm[i].buffer, cm[i].sz);
+			}
+			n += count;
+		}
+		struct pool_message pm[16];
+		while ((count = cp_poll_batch(server, pm, 16)) > 0) {
+			for (i=0;i<count;i++) {
+				if (pm[i].type == POOL_OUT)
+					cc_recv(client, pm[i].buffer, pm[i].sz);
+				else
+					cp_send(server, pm[i].id, pm[i].buffer, pm[i].sz);
+			}
+			n += count;
+		}
+	} while (n != last);
+	return n;
+}
+
+static void
+test_alloc(struct connection_pool * server) {
+	static char buffer[1000];
+	struct connection * client = cc_open();
+	int i;
+	int n = 0;
+	for (i=0;i<1000;i++) {
+		cc_send(client, buffer, i % 1000 + 1);
+		echo(server, client);
+	}
+	malloc_count = 0;
+	for (i=0;i<1000;i++) {
+		cc_send(client, buffer, i % 1000 + 1);
+		n += echo(server, client);
+	}
+	printf("%d messages, malloc %d\n", n, malloc_count);
+	cc_close(client);
+}
+
+// two sessions, 100 interleaved cp_send for each between polls
+static void
+test_coalesce(struct connection_pool * server) {
+	struct connection * client[2] = { cc_open(), cc_open() };
+	int id[2];
+	int i;
+	for (i=0;i<2;i++) {
+		cc_send(client[i], "x", 1);
+		int n;
+		do {
+			n = 0;
+			struct connection_message cm;
+			while (cc_poll(client[i], &cm) != MESSAGE_EMPTY) {
+				cp_recv(server, 2+i, cm.buffer, cm.sz);
+				++n;
+			}
+			struct pool_message pm;
+			int type;
+			while ((type = cp_poll(server, &pm)) != POOL_EMPTY) {
+				if (type == POOL_IN)
+					id[i] = pm.id;
+				else
+					cc_recv(client[i], pm.buffer, pm.sz);
+				++n;
+			}
+		} while (n > 0);
+	}
+	for (i=0;i<200;i++) {
+		cp_send(server, id[i%2], "0123456789", 10);
+	}
+	int write[2] = { 0, 0 };
+	int recv[2] = { 0, 0 };
+	struct pool_message pm;
+	while (cp_poll(server, &pm) != POOL_EMPTY) {
+		int c = pm.id - 2;
+		++write[c];
+		cc_recv(client[c], pm.buffer, pm.sz);
+	}
+	for (i=0;i<2;i++) {
+		struct connection_message cm;
+		while (cc_poll(client[i], &cm) != MESSAGE_EMPTY) {
+			recv[i] += cm.sz;
+		}
+		printf("100 cp_send : %d write, %d bytes\n", write[i], recv[i]);
+		cc_close(client[i]);
+	}
+}
+
+// decrypt in the recv buffer on both sides, only handshake goes through the queue
+static void
+test_inplace(struct connection_pool * server) {
+	struct connection * client = cc_open();
+	char buffer[1024];
+	int i, n, type;
+	int in = 0, bytes = 0;
+	for (i=0;i<3;i++) {
+		cc_send(client, "hello", 5);
+	}
+	do {
+		n = 0;
+		struct connection_message cm;
+		while (cc_poll(client, &cm) != MESSAGE_EMPTY) {
+			struct pool_message pm;
+			memcpy(buffer, cm.buffer, cm.sz);
+			if (cp_recv_inplace(server, 4, buffer, cm.sz, &pm) == POOL_IN) {
+				in += (int)pm.sz;
+				cp_send(server, pm.id, pm.buffer, pm.sz);
+			}
+			++n;
+		}
+		struct pool_message pm;
+		while ((type = cp_poll(server, &pm)) != POOL_EMPTY) {
+			memcpy(buffer, pm.buffer, pm.sz);
+			if (cc_recv_inplace(client, buffer, pm.sz, &cm) == MESSAGE_IN) {
+				bytes += cm.sz;
+				if (memcmp(cm.buffer, "hello", 5) != 0)
+					printf("inplace : bad data\n");
+			}
+			++n;
+		}
+	} while (n > 0);
+	printf("inplace : server %d bytes, client %d bytes\n", in, bytes);
+	cc_close(client);
+}
+
+struct callback {
+	struct connection_pool *server;
+	struct connection *client;
+	int data;
+	int write;
+};
+
+static void
+on_data(void *ud, int id, const char *buffer, size_t sz) {
+	struct callback *cb = ud;
+	cb->data += (int)sz;
+	// echo inside the callback
+	cp_send(cb->server, id, buffer, sz);
+}
+
+static void
+on_write(void *ud, int fd, const char *buffer, size_t sz) {
+	struct callback *cb = ud;
+	++cb->write;
+	cc_recv(cb->client, buffer, sz);
+}
+
+// no cp_poll in callback mode
+static void
+test_callback() {
+	struct callback cb = { NULL, cc_open(), 0, 0 };
+	struct cp_config cfg = { .on_data = on_data, .on_write = on_write, .ud = &cb };
+	cb.server = cp_new_ex(&cfg);
+	int i;
+	for (i=0;i<3;i++) {
+		cc_send(cb.client, "hello", 5);
+	}
+	int bytes = 0;
+	int n;
+	do {
+		n = 0;
+		struct connection_message cm;
+		int type;
+		while ((type = cc_poll(cb.client, &cm)) != MESSAGE_EMPTY) {
+			if (type == MESSAGE_OUT)
+				cp_recv(cb.server, 5, cm.buffer, cm.sz);
+			else
+				bytes += cm.sz;
+			++n;
+		}
+	} while (n > 0);
+	struct pool_message pm;
+	printf("callback : server %d bytes, %d write, client %d bytes, poll %d\n", cb.data, cb.write, bytes, cp_poll(cb.server, &pm));
+	cc_close(cb.client);
+	cp_delete(cb.server);
+}
+
+static int evicted = 0;
+static int reopened = 0;
+static int last_id = 0;
+
+// echo the messages of one client on fd until quiet, return the bytes received by server, or -1 if fd is closed
+static int
+pump(struct connection_pool * server, struct connection * client, int fd) {
+	int bytes = 0;
+	int n;
+	do {
+		n = 0;
+		struct connection_message cm;
+		int type;
+		while ((type = cc_poll(client, &cm)) != MESSAGE_EMPTY) {
+			if (type == MESSAGE_OUT)
+				cp_recv(server, fd, cm.buffer, cm.sz);
+			++n;
+		}
+		struct pool_message pm;
+		while ((type = cp_poll(server, &pm)) != POOL_EMPTY) {
+			if (type == POOL_IN) {
+				bytes += pm.sz;
+				last_id = pm.id;
+				cp_send(server, pm.id, pm.buffer, pm.sz);
+			} else if (type == POOL_EVICT) {
+				++evicted;
+			} else if (type == POOL_WINDOW) {
+				reopened = pm.id;
+			} else if (pm.sz == 0) {
+				return -1;
+			} else {
+				cc_recv(client, pm.buffer, pm.sz);
+			}
+			++n;
+		}
+	} while (n > 0);
+	return bytes;
+}
+
+// the replay cache is allocated when a session starts, and reused after it's closed
+static void
+test_lazy() {
+	struct connection_pool * server = cp_new();
+	struct connection * client[100];
+	int id[100];
+	int count[2];
+	int i, round;
+	for (round=0;round<2;round++) {
+		for (i=0;i<100;i++) {
+			client[i] = cc_open();
+			cc_send(client[i], "x", 1);
+		}
+		malloc_count = 0;
+		for (i=0;i<100;i++) {
+			pump(server, client[i], 100+i);
+			id[i] = last_id;
+		}
+		for (i=0;i<100;i++) {
+			cp_send(server, id[i], NULL, 0);
+			pump(server, client[i], 100+i);
+		}
+		count[round] = malloc_count;
+		for (i=0;i<100;i++) {
+			cc_close(client[i]);
+		}
+	}
+	printf("lazy : 100 sessions malloc %d, again %d\n", count[0], count[1]);
+	cp_delete(server);
+}
+
+// pagesize must be a multiple of fingerprint. with sendcache 1024, a session that missed
+// 500 bytes resumes, and one that missed 3000 bytes is reset
+static void
+test_config() {
+	struct cp_config bad = { .pagesize = 1000, .fingerprint = 256 };
+	int invalid = cp_new_ex(&bad) == NULL;
+	struct cp_config cfg = { .sendcache = 1024, .pagesize = 512, .fingerprint = 128 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct cc_config ccfg = { .fingerprint = 128 };
+	char buffer[3000];
+	memset(buffer, 0, sizeof(buffer));
+	int lost[2] = { 500, 3000 };
+	int resume[2];
+	int i;
+	for (i=0;i<2;i++) {
+		struct connection * client = cc_open_ex(&ccfg);
+		cc_send(client, "x", 1);
+		pump(server, client, 110+i);
+		// the client never receives them
+		cp_send(server, last_id, buffer, lost[i]);
+		struct pool_message pm;
+		while (cp_poll(server, &pm) != POOL_EMPTY)
+			;
+		cp_recv(server, 110+i, NULL, 0);
+		cc_handshake(client);
+		cc_send(client, "y", 1);
+		resume[i] = pump(server, client, 112+i);
+		cc_close(client);
+	}
+	printf("config : invalid geometry %d, resume %d, out of window %d\n", invalid, resume[0], resume[1]);
+	cp_delete(server);
+}
+
+// 50 sessions detached at different offsets past the first checkpoint resume in reverse order,
+// each one must be found by its fingerprint
+static void
+test_index() {
+	struct connection_pool * server = cp_new();
+	struct connection * client[50];
+	int id[50];
+	char buffer[400];
+	memset(buffer, 0, sizeof(buffer));
+	int i;
+	for (i=0;i<50;i++) {
+		client[i] = cc_open();
+		cc_send(client[i], "x", 1);
+		pump(server, client[i], 200+i);
+		id[i] = last_id;
+		cp_send(server, id[i], buffer, 300+i);
+		pump(server, client[i], 200+i);
+		cp_recv(server, 200+i, NULL, 0);
+		cc_handshake(client[i]);
+	}
+	int same = 0;
+	for (i=49;i>=0;i--) {
+		cc_send(client[i], "y", 1);
+		if (pump(server, client[i], 300+i) == 1 && last_id == id[i])
+			++same;
+		cc_close(client[i]);
+	}
+	printf("index : %d of 50 resumed\n", same);
+	cp_delete(server);
+}
+
+// 300 sessions one after another in a pool of 1 slot, the version wraps. the id of 100 sessions ago
+// has the same slot, it must not reach the current session
+static void
+test_stale() {
+	struct cp_config cfg = { .maxslot = 1 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	int id[300];
+	int accepted = 0;
+	int delivered = 0;
+	int i;
+	for (i=0;i<300;i++) {
+		struct connection * client = cc_open();
+		cc_send(client, "x", 1);
+		if (pump(server, client, 400) == 1)
+			++accepted;
+		id[i] = last_id;
+		if (i >= 100) {
+			cp_send(server, id[i-100], "z", 1);
+			struct pool_message pm;
+			while (cp_poll(server, &pm) != POOL_EMPTY)
+				++delivered;
+		}
+		cp_send(server, id[i], NULL, 0);
+		pump(server, client, 400);
+		cc_close(client);
+	}
+	printf("stale : %d of 300 sessions, %d stale sends delivered\n", accepted, delivered);
+	cp_delete(server);
+}
+
+// 600 sessions at once grow the table to 3 segments, the first session still works after that.
+// the 601st is closed for maxslot
+static void
+test_grow() {
+	struct cp_config cfg = { .maxslot = 600 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct connection * client[601];
+	int echo = 0;
+	int rejected = 0;
+	int i;
+	for (i=0;i<601;i++) {
+		client[i] = cc_open();
+		cc_send(client[i], "x", 1);
+		int r = pump(server, client[i], 500+i);
+		if (r == 1)
+			++echo;
+		else if (r < 0)
+			++rejected;
+	}
+	cc_send(client[0], "y", 1);
+	int first = pump(server, client[0], 500);
+	printf("grow : %d of 601 sessions, first %d, rejected %d\n", echo, first, rejected);
+	for (i=0;i<601;i++) {
+		cc_close(client[i]);
+	}
+	cp_delete(server);
+}
+
+// 5000 bytes the client missed are replayed from 5 pages of 1024 bytes, one write per page
+// after the handshake reply
+static void
+test_replay() {
+	struct cp_config cfg = { .pagesize = 1024 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct connection * client = cc_open();
+	cc_send(client, "x", 1);
+	pump(server, client, 1200);
+	char buffer[5000];
+	int i;
+	for (i=0;i<5000;i++) {
+		buffer[i] = (char)i;
+	}
+	cp_send(server, last_id, buffer, 5000);
+	struct pool_message pm;
+	while (cp_poll(server, &pm) != POOL_EMPTY)
+		;
+	cp_recv(server, 1200, NULL, 0);
+	cc_handshake(client);
+	int bytes = 0;
+	int bad = 0;
+	int write = 0;
+	int n;
+	do {
+		n = 0;
+		struct connection_message cm;
+		int type;
+		while ((type = cc_poll(client, &cm)) != MESSAGE_EMPTY) {
+			if (type == MESSAGE_OUT) {
+				cp_recv(server, 1201, cm.buffer, cm.sz);
+			} else {
+				for (i=0;i<cm.sz;i++) {
+					bad += cm.buffer[i] != (char)(bytes + i);
+				}
+				bytes += cm.sz;
+			}
+			++n;
+		}
+		while (cp_poll(server, &pm) != POOL_EMPTY) {
+			cc_recv(client, pm.buffer, pm.sz);
+			++write;
+			++n;
+		}
+	} while (n > 0);
+	printf("replay : %d bytes in %d writes, %d bad\n", bytes, write, bad);
+	cc_close(client);
+	cp_delete(server);
+}
+
+// a session moves from fd 700 to fd 701 before the close of fd 700 arrives. the late close must
+// not detach it, and fd 700 is free for a new session
+static void
+test_fd() {
+	struct connection_pool * server = cp_new();
+	struct connection * client = cc_open();
+	cc_send(client, "x", 1);
+	pump(server, client, 700);
+	cc_handshake(client);
+	cc_send(client, "y", 1);
+	int resume = pump(server, client, 701);
+	cp_recv(server, 700, NULL, 0);
+	// fd 700 is not known any more, it's kicked as an empty handshake
+	struct pool_message pm;
+	while (cp_poll(server, &pm) != POOL_EMPTY)
+		;
+	cc_send(client, "z", 1);
+	int after = pump(server, client, 701);
+	struct connection * other = cc_open();
+	cc_send(other, "w", 1);
+	int reuse = pump(server, other, 700);
+	printf("fd : resume %d, after late close %d, fd reused %d\n", resume, after, reuse);
+	cc_close(client);
+	cc_close(other);
+	cp_delete(server);
+}
+
+// with maxhandshake 2, a third fd in handshake is closed at once without malloc.
+// a new fd is accepted again after the first two finish
+static void
+test_maxhandshake() {
+	struct cp_config cfg = { .maxhandshake = 2 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct connection * client[3];
+	struct connection_message cm;
+	int i;
+	for (i=0;i<3;i++) {
+		client[i] = cc_open();
+		cc_send(client[i], "x", 1);
+	}
+	for (i=0;i<2;i++) {
+		cc_poll(client[i], &cm);
+		cp_recv(server, 800+i, cm.buffer, cm.sz);
+	}
+	malloc_count = 0;
+	cc_poll(client[2], &cm);
+	cp_recv(server, 802, cm.buffer, cm.sz);
+	int alloc = malloc_count;
+	int closed = -1;
+	struct pool_message pm;
+	while (cp_poll(server, &pm) != POOL_EMPTY) {
+		if (pm.sz == 0)
+			closed = pm.id;
+		else
+			cc_recv(client[pm.id - 800], pm.buffer, pm.sz);
+	}
+	int echo = pump(server, client[0], 800) + pump(server, client[1], 801);
+	cc_close(client[2]);
+	client[2] = cc_open();
+	cc_send(client[2], "y", 1);
+	int retry = pump(server, client[2], 803);
+	printf("maxhandshake : fd %d closed, malloc %d, echo %d, retry %d\n", closed, alloc, echo, retry);
+	for (i=0;i<3;i++) {
+		cc_close(client[i]);
+	}
+	cp_delete(server);
+}
+
+// an unfinished handshake is closed after 10 ticks, a detached session is released after 100 ticks
+static void
+test_timeout() {
+	struct cp_config cfg = { .handshake_timeout = 10, .detached_timeout = 100 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	unsigned int tick = 1000;
+	cp_timeout(server, tick);
+
+	struct connection * client[3] = { cc_open(), cc_open(), cc_open() };
+	struct connection_message cm;
+	cc_poll(client[0], &cm);
+	cp_recv(server, 7, cm.buffer, 4);
+	int i;
+	for (i=1;i<3;i++) {
+		cc_send(client[i], "x", 1);
+		pump(server, client[i], 7+i);
+		cp_recv(server, 7+i, NULL, 0);
+		cc_handshake(client[i]);
+	}
+	int closed = 0;
+	struct pool_message pm;
+	while (closed == 0) {
+		cp_timeout(server, ++tick);
+		while (cp_poll(server, &pm) != POOL_EMPTY) {
+			if (pm.id == 7 && pm.sz == 0)
+				closed = tick - 1000;
+		}
+	}
+	tick = 1050;
+	cp_timeout(server, tick);
+	int resume = pump(server, client[1], 10);
+	cp_timeout(server, tick += 50);
+	int expired = pump(server, client[2], 11);
+	printf("timeout : handshake closed after %d ticks, resume %d after 50 ticks, %d after 100 ticks\n", closed, resume, expired);
+	for (i=0;i<3;i++) {
+		cc_close(client[i]);
+	}
+	cp_delete(server);
+}
+
+// a tick going back is ignored, a jump of 700 ticks expires the session detached 1200 ticks ago only
+static void
+test_clock() {
+	struct cp_config cfg = { .detached_timeout = 1000 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct connection * client[2] = { cc_open(), cc_open() };
+	unsigned int tick = 100;
+	cp_timeout(server, tick);
+	int i;
+	for (i=0;i<2;i++) {
+		cc_send(client[i], "x", 1);
+		pump(server, client[i], 7+i);
+		cp_recv(server, 7+i, NULL, 0);
+		cc_handshake(client[i]);
+		if (i == 0)
+			cp_timeout(server, tick += 500);
+	}
+	cp_timeout(server, 99);
+	cp_timeout(server, 1300);
+	int expired = pump(server, client[0], 9);
+	int resume = pump(server, client[1], 10);
+	printf("clock : back to tick 99, after 700 ticks %d and %d\n", expired, resume);
+	for (i=0;i<2;i++) {
+		cc_close(client[i]);
+	}
+	cp_delete(server);
+}
+
+// the budget holds 2 connections, the oldest detached one is evicted for the third
+static void
+test_evict() {
+	struct cp_config cfg = { .pagesize = 1024, .memory = 4000 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct connection * client[3] = { cc_open(), cc_open(), cc_open() };
+	int i;
+	for (i=0;i<3;i++) {
+		cc_send(client[i], "x", 1);
+		pump(server, client[i], 20+i);
+		if (i < 2) {
+			cp_recv(server, 20+i, NULL, 0);
+			cc_handshake(client[i]);
+		}
+	}
+	int resume = pump(server, client[0], 23);
+	int other = pump(server, client[1], 24);
+	// reset by server, so it's a new session. no detached connection to evict now
+	cc_handshake(client[0]);
+	cc_send(client[0], "y", 1);
+	int fresh = pump(server, client[0], 25);
+	printf("evict : %d evicted, resume %d, new session %d, other resume %d\n", evicted, resume, fresh, other);
+	for (i=0;i<3;i++) {
+		cc_close(client[i]);
+	}
+	cp_delete(server);
+}
+
+// the server holds at most sendcache unacked bytes, the client acks every 500 bytes
+static void
+test_ack() {
+	struct cp_config cfg = { .sendcache = 1000, .ack = 1 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct cc_config ccfg = { .ack = 500 };
+	struct connection * client = cc_open_ex(&ccfg);
+	char buffer[600];
+	memset(buffer, 0, sizeof(buffer));
+	cc_send(client, "hello", 5);
+	int echo = pump(server, client, 30);
+	int first = cp_send(server, last_id, buffer, 600);
+	int blocked = cp_send(server, last_id, buffer, 600);
+	pump(server, client, 30);
+	int acked = cp_send(server, last_id, buffer, 600);
+	pump(server, client, 30);
+	printf("ack : echo %d, send %d, blocked %d, after ack %d\n", echo, first, blocked, acked);
+	cc_close(client);
+	cp_delete(server);
+}
+
+// the client acks every 5000 bytes, but the window of the server is 1000
+static void
+test_window() {
+	struct cp_config cfg = { .sendcache = 1000, .ack = 1 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct cc_config ccfg = { .ack = 5000, .window = 1000 };
+	struct connection * client = cc_open_ex(&ccfg);
+	char buffer[1001];
+	memset(buffer, 0, sizeof(buffer));
+	cc_send(client, "hello", 5);
+	pump(server, client, 30);
+	int oversize = cp_send(server, last_id, buffer, 1001);
+	int sent = 0;
+	int i;
+	for (i=0;i<100;i++) {
+		if (cp_send(server, last_id, buffer, 400) == 0)
+			sent += 400;
+		pump(server, client, 30);
+	}
+	printf("window : oversize %d, sent %d\n", oversize, sent);
+	cc_close(client);
+	cp_delete(server);
+}
+
+// a message refused for the window is sent again after POOL_WINDOW
+static void
+test_reopen() {
+	struct cp_config cfg = { .sendcache = 1000, .ack = 1 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct cc_config ccfg = { .ack = 400, .window = 1000 };
+	struct connection * client = cc_open_ex(&ccfg);
+	char buffer[600];
+	memset(buffer, 0, sizeof(buffer));
+	cc_send(client, "hello", 5);
+	pump(server, client, 30);
+	reopened = 0;
+	int first = cp_send(server, last_id, buffer, 600);
+	int refused = cp_send(server, last_id, buffer, 600);
+	pump(server, client, 30);
+	int again = reopened == last_id ? cp_send(server, last_id, buffer, 600) : -1;
+	printf("reopen : send %d, refused %d, reopened %d, send again %d\n", first, refused, reopened == last_id, again);
+	cc_close(client);
+	cp_delete(server);
+}
+
+struct shard_test {
+	pthread_mutex_t lock;
+	struct connection *client;
+	struct shard_pool *sp;
+	int id;
+};
+
+static void
+shard_echo(void *ud, int id, const char *buffer, size_t sz) {
+	struct shard_test *t = ud;
+	t->id = id;
+	cs_send(t->sp, id, buffer, sz);
+}
+
+static void
+shard_write(void *ud, int fd, const char *buffer, size_t sz) {
+	struct shard_test *t = ud;
+	pthread_mutex_lock(&t->lock);
+	cc_recv(t->client, buffer, sz);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static int
+shard_pump(struct shard_test *t, int fd) {
+	int bytes = 0;
+	int n;
+	do {
+		n = 0;
+		// the client is written by the shard thread once cs_recv is called
+		char out[1024];
+		int sz = 0;
+		struct connection_message m;
+		int type;
+		while ((type = cc_poll(t->client, &m)) != MESSAGE_EMPTY) {
+			if (type == MESSAGE_OUT) {
+				memcpy(out + sz, m.buffer, m.sz);
+				sz += m.sz;
+			} else {
+				bytes += m.sz;
+			}
+			++n;
+		}
+		if (sz > 0)
+			cs_recv(t->sp, fd, out, sz);
+		cs_wait(t->sp);
+	} while (n > 0);
+	return bytes;
+}
+
+// a session of fd 0 (shard 0) is resumed by fd 1, it's routed back to shard 0
+static void
+test_shard() {
+	struct shard_test t;
+	pthread_mutex_init(&t.lock, NULL);
+	t.client = cc_open();
+	struct cs_config cfg = { .shards = 2, .pool = { .on_data = shard_echo, .on_write = shard_write, .ud = &t } };
+	t.sp = cs_new(&cfg);
+	cc_send(t.client, "hello", 5);
+	int echo = shard_pump(&t, 0);
+	int id = t.id;
+	cs_recv(t.sp, 0, NULL, 0);
+	cc_handshake(t.client);
+	cc_send(t.client, "world", 5);
+	int resume = shard_pump(&t, 1);
+	printf("shard : echo %d, resume %d, same id %d\n", echo, resume, id == t.id);
+	cs_delete(t.sp);
+	cc_close(t.client);
+	pthread_mutex_destroy(&t.lock);
+}
+
+static int shard_closed = -1;
+
+static void
+shard_onclose(void *ud, int fd) {
+	__atomic_store_n(&shard_closed, fd, __ATOMIC_RELEASE);
+}
+
+// 3 bytes of header on fd 5 are handed to a shard after 10 ticks, its pool closes fd 5 10 ticks later
+static void
+test_shard_partial() {
+	struct shard_test t;
+	struct cs_config cfg = { .shards = 2, .pool = { .handshake_timeout = 10, .on_data = shard_echo, .on_write = shard_write, .on_close = shard_onclose, .ud = &t } };
+	t.sp = cs_new(&cfg);
+	cs_timeout(t.sp, 100);
+	cs_recv(t.sp, 5, "\0\0\0", 3);
+	cs_timeout(t.sp, 109);
+	cs_wait(t.sp);
+	int early = __atomic_load_n(&shard_closed, __ATOMIC_ACQUIRE);
+	cs_timeout(t.sp, 110);
+	cs_timeout(t.sp, 125);
+	cs_wait(t.sp);
+	int closed = __atomic_load_n(&shard_closed, __ATOMIC_ACQUIRE);
+	printf("shard partial : closed %d at tick 109, %d at tick 125\n", early, closed);
+	cs_delete(t.sp);
+}
+
+// the D-H is done by a crypto thread, the shard thread replies the handshake without a request
+static void
+test_shard_crypto() {
+	struct shard_test t;
+	pthread_mutex_init(&t.lock, NULL);
+	t.client = cc_open();
+	struct cs_config cfg = { .shards = 2, .pool = { .crypto = 1, .on_data = shard_echo, .on_write = shard_write, .ud = &t } };
+	t.sp = cs_new(&cfg);
+	cc_send(t.client, "hello", 5);
+	int echo = 0;
+	int i;
+	for (i=0;i<100 && echo == 0;i++) {
+		// the reply may arrive after cs_wait, so the client is locked
+		char out[1024];
+		int sz = 0;
+		struct connection_message m;
+		int type;
+		pthread_mutex_lock(&t.lock);
+		while ((type = cc_poll(t.client, &m)) != MESSAGE_EMPTY) {
+			if (type == MESSAGE_OUT) {
+				memcpy(out + sz, m.buffer, m.sz);
+				sz += m.sz;
+			} else {
+				echo += m.sz;
+			}
+		}
+		pthread_mutex_unlock(&t.lock);
+		if (sz > 0)
+			cs_recv(t.sp, 0, out, sz);
+		usleep(10000);
+	}
+	printf("shard crypto : echo %d\n", echo);
+	cs_delete(t.sp);
+	cc_close(t.client);
+	pthread_mutex_destroy(&t.lock);
+}
+
+struct submit_test {
+	struct connection_pool *server;
+	int id;
+	int messages;
+};
+
+static void *
+submit_thread(void *ud) {
+	struct submit_test *t = ud;
+	int i;
+	for (i=0;i<t->messages;i++) {
+		char *buffer = malloc(4);
+		memcpy(buffer, "abcd", 4);
+		while (cp_submit(t->server, t->id, buffer, 4) < 0) {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+// 4 threads submit to a ring of 16 while the pool thread drains it
+static void
+test_submit() {
+	struct cp_config cfg = { .submit = 16 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct connection * client = cc_open();
+	cc_send(client, "x", 1);
+	pump(server, client, 40);
+	struct submit_test t = { server, last_id, 1 };
+	submit_thread(&t);
+	t.messages = 100;
+	uint64_t value;
+	int signaled = read(cp_submitfd(server), &value, sizeof(value)) == sizeof(value);
+	pthread_t thread[4];
+	int i;
+	for (i=0;i<4;i++) {
+		pthread_create(&thread[i], NULL, submit_thread, &t);
+	}
+	int bytes = 0;
+	while (bytes < 4 + 4 * 4 * t.messages) {
+		struct pool_message pm;
+		while (cp_poll(server, &pm) == POOL_OUT) {
+			cc_recv(client, pm.buffer, pm.sz);
+		}
+		struct connection_message cm;
+		while (cc_poll(client, &cm) != MESSAGE_EMPTY) {
+			bytes += cm.sz;
+		}
+	}
+	for (i=0;i<4;i++) {
+		pthread_join(thread[i], NULL);
+	}
+	printf("submit : %d bytes, signaled %d\n", bytes, signaled);
+	cc_close(client);
+	cp_delete(server);
+}
+
+// 10 submits of 400 bytes wait for the acks in a window of 1000 bytes, the oversize one is dropped
+static void
+test_submit_ack() {
+	struct cp_config cfg = { .submit = 16, .sendcache = 1000, .ack = 1 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct cc_config ccfg = { .ack = 500 };
+	struct connection * client = cc_open_ex(&ccfg);
+	cc_send(client, "x", 1);
+	pump(server, client, 41);
+	cp_submit(server, last_id, calloc(1, 1001), 1001);
+	int i;
+	for (i=0;i<10;i++) {
+		cp_submit(server, last_id, calloc(1, 400), 400);
+	}
+	int bytes = 0;
+	int n;
+	do {
+		n = 0;
+		struct pool_message pm;
+		while (cp_poll(server, &pm) == POOL_OUT) {
+			cc_recv(client, pm.buffer, pm.sz);
+			++n;
+		}
+		struct connection_message cm;
+		int type;
+		while ((type = cc_poll(client, &cm)) != MESSAGE_EMPTY) {
+			if (type == MESSAGE_OUT)
+				cp_recv(server, 41, cm.buffer, cm.sz);
+			else
+				bytes += cm.sz;
+			++n;
+		}
+	} while (n > 0);
+	printf("submit ack : %d bytes\n", bytes);
+	cc_close(client);
+	cp_delete(server);
+}
+
+// pump until echo, waiting for the crypto threads
+static int
+crypto_pump(struct connection_pool * server, struct connection * client, int fd) {
+	int i;
+	for (i=0;i<100;i++) {
+		int bytes = pump(server, client, fd);
+		if (bytes != 0)
+			return bytes;
+		struct pollfd pfd = { cp_submitfd(server), POLLIN, 0 };
+		poll(&pfd, 1, 100);
+	}
+	return 0;
+}
+
+// the D-H of new handshakes is computed by crypto threads. the first handshake of fd 50 is closed
+// before its D-H is done, and the completion must not be replied to the next one of fd 50
+static void
+test_crypto() {
+	struct cp_config cfg = { .crypto = 2 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct connection * stale = cc_open();
+	struct connection_message cm;
+	while (cc_poll(stale, &cm) == MESSAGE_OUT) {
+		cp_recv(server, 50, cm.buffer, cm.sz);
+	}
+	cp_recv(server, 50, NULL, 0);
+	struct pool_message pm;
+	while (cp_poll(server, &pm) != POOL_EMPTY)
+		;
+	struct connection * client = cc_open();
+	cc_send(client, "hello", 5);
+	// the job is in the handshake, posting it doesn't malloc
+	cc_poll(client, &cm);
+	malloc_count = 0;
+	cp_recv(server, 50, cm.buffer, cm.sz);
+	int alloc = malloc_count;
+	int echo = crypto_pump(server, client, 50);
+	printf("crypto : echo %d, malloc %d\n", echo, alloc);
+	cc_close(stale);
+	cc_close(client);
+	cp_delete(server);
+}
+
+// 2 keys in the reservoir, the third handshake computes its own key, cp_timeout refills
+static void
+test_keypair() {
+	struct cp_config cfg = { .keypairs = 2 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct connection * client[4];
+	int echo = 0;
+	int i;
+	cp_timeout(server, 0);
+	for (i=0;i<4;i++) {
+		if (i == 3)
+			cp_timeout(server, 1);
+		client[i] = cc_open();
+		cc_send(client[i], "x", 1);
+		echo += pump(server, client[i], 60+i);
+	}
+	printf("keypair : echo %d\n", echo);
+	for (i=0;i<4;i++) {
+		cc_close(client[i]);
+	}
+	cp_delete(server);
+}
+
+// the bit serial multiply and recursive pow of the first version, for a < P and b > 0
+#define P 0xffffffffffffffc5ull
+
+static uint64_t
+ref_mul_mod_p(uint64_t a, uint64_t b) {
+	uint64_t m = 0;
+	while(b) {
+		if(b&1) {
+			uint64_t t = P-a;
+			if ( m >= t) {
+				m -= t;
+			} else {
+				m += a;
+			}
+		}
+		if (a >= P - a) {
+			a = a * 2 - P;
+		} else {
+			a = a * 2;
+		}
+		b>>=1;
+	}
+	return m;
+}
+
+static uint64_t
+ref_pow_mod_p(uint64_t a, uint64_t b) {
+	if (b==1) {
+		return a;
+	}
+	uint64_t t = ref_pow_mod_p(a, b>>1);
+	t = ref_mul_mod_p(t,t);
+	if (b % 2) {
+		t = ref_mul_mod_p(t, a);
+	}
+	return t;
+}
+
+static uint64_t
+random64() {
+	return (uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ rand();
+}
+
+static void
+test_powmodp() {
+	uint64_t edge[] = { 0, 1, 2, 5, 59, 60, 0xffffffffull, 1ull << 63, P - 2, P - 1 };
+	int n = sizeof(edge) / sizeof(edge[0]);
+	int cases = 0;
+	int mismatch = 0;
+	int i,j;
+	for (i=0;i<n;i++) {
+		for (j=0;j<n;j++) {
+			uint64_t b = edge[j] == 0 ? P - 1 : edge[j];
+			mismatch += powmodp(edge[i], b) != ref_pow_mod_p(edge[i], b);
+			++cases;
+		}
+	}
+	srand(1);
+	for (i=0;i<10000;i++) {
+		uint64_t a = random64() % P;
+		uint64_t b = random64();
+		if (b == 0)
+			b = 1;
+		// b = 2 is a single square
+		mismatch += powmodp(a, 2) != ref_pow_mod_p(a, 2);
+		mismatch += powmodp(a, b) != ref_pow_mod_p(a, b);
+		cases += 2;
+	}
+	printf("powmodp : %d cases, %d mismatch\n", cases, mismatch);
+	cases = 0;
+	mismatch = 0;
+	for (i=0;i<n;i++) {
+		if (edge[i] == 0)
+			mismatch += powmodg(0) != 1;
+		else
+			mismatch += powmodg(edge[i]) != ref_pow_mod_p(5, edge[i]);
+		++cases;
+	}
+	for (i=0;i<10000;i++) {
+		uint64_t b = random64();
+		if (b == 0)
+			b = 1;
+		mismatch += powmodg(b) != ref_pow_mod_p(5, b);
+		++cases;
+	}
+	printf("powmodg : %d cases, %d mismatch\n", cases, mismatch);
+}
+
+static void
+test_random() {
+	struct random_state a, b, c;
+	int same = 0;
+	int diverge = 0;
+	int zero = 0;
+	int i;
+	random_init(&a, 42);
+	random_init(&b, 42);
+	random_fork(&a, &c);
+	random_init(&a, 42);
+	for (i=0;i<1000;i++) {
+		uint64_t x = random_next(&a);
+		same += x == random_next(&b);
+		diverge += x != random_next(&c);
+		zero += x == 0;
+	}
+	struct cp_config cfg = { .seed = 1 };
+	struct connection_pool * server = cp_new_ex(&cfg);
+	struct cc_config ccfg = { .seed = 2 };
+	struct connection * client = cc_open_ex(&ccfg);
+	cc_send(client, "x", 1);
+	int echo = pump(server, client, 70);
+	printf("random : same %d, diverge %d, zero %d, echo %d\n", same, diverge, zero, echo);
+	cc_close(client);
+	cp_delete(server);
+}
+
 int
 main() {
 	struct connection_pool * server = cp_new();
 
 	test(server);
+	test_lazy();
+	test_config();
+	test_index();
+	test_stale();
+	test_grow();
+	test_replay();
+	test_fd();
+	test_maxhandshake();
+	test_alloc(server);
+	test_coalesce(server);
+	test_inplace(server);
+	test_callback();
+	test_timeout();
+	test_clock();
+	test_evict();
+	test_ack();
+	test_window();
+	test_reopen();
+	test_shard();
+	test_shard_crypto();
+	test_shard_partial();
+	test_submit();
+	test_submit_ack();
+	test_crypto();
+	test_keypair();
+	test_powmodp();
+	test_random();
 
 	cp_delete(server);
 